@@ -10,8 +10,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void extern_fun_builtin(Ctx *ctx);
-
 // ###############################################
 // ソースコード
 // ###############################################
@@ -130,7 +128,7 @@ static bool is_op_char(char c) { return strchr("+-*/%&|^~!=<>.?:", c) != NULL; }
 // トークンリスト
 // -----------------------------------------------
 
-static void tok_add(Ctx *ctx, enum TokKind kind, int src_l, int src_r) {
+static int tok_add(Ctx *ctx, enum TokKind kind, int src_l, int src_r) {
     assert(src_l <= src_r && (kind == tok_eof || src_l < src_r));
 
     vec_grow((void **)&ctx->toks.data, ctx->toks.len, &ctx->toks.capacity,
@@ -143,7 +141,9 @@ static void tok_add(Ctx *ctx, enum TokKind kind, int src_l, int src_r) {
         .kind = kind,
         .src_l = src_l,
         .src_r = src_r,
+        .sym_i = -1,
     };
+    return tok_i;
 }
 
 static struct Tok *tok_get(Ctx *ctx, int tok_i) {
@@ -160,29 +160,110 @@ static const char *tok_text(Ctx *ctx, int tok_i) {
     return src_slice(ctx, tok->src_l, tok->src_r);
 }
 
+// トークンの文字列が expected に等しいか。
+// 文字列を切り出さずに、ソースコード上で直接比較する。
 static bool tok_text_equals(Ctx *ctx, int tok_i, const char *expected) {
-    // HELP: We could optimize this.
-    return strcmp(tok_text(ctx, tok_i), expected) == 0;
+    struct Tok *tok = tok_get(ctx, tok_i);
+    int len = tok->src_r - tok->src_l;
+    return strncmp(ctx->src + tok->src_l, expected, len) == 0 &&
+           expected[len] == '\0';
 }
 
-struct TextTokKind {
-    char const *text;
-    enum TokKind kind;
-};
+// 識別子の文字列がキーワードなら、そのトークンの種類を返す。
+// 長さと先頭の文字で候補を1つに絞ってから比較する。
+static enum TokKind tok_keyword_kind(const char *text, int len) {
+    const char *keyword;
+    TokKind kind;
+
+    switch (len) {
+    case 2:
+        keyword = "if";
+        kind = tok_if;
+        break;
+    case 3:
+        keyword = text[0] == 'l' ? "let" : "fun";
+        kind = text[0] == 'l' ? tok_let : tok_fun;
+        break;
+    case 4:
+        keyword = "else";
+        kind = tok_else;
+        break;
+    case 5:
+        keyword = text[0] == 'w' ? "while" : "break";
+        kind = text[0] == 'w' ? tok_while : tok_break;
+        break;
+    case 6:
+        keyword = "return";
+        kind = tok_return;
+        break;
+    default:
+        return tok_ident;
+    }
+
+    return memcmp(text, keyword, len) == 0 ? kind : tok_ident;
+}
+
+// -----------------------------------------------
+// シンボルリスト
+// -----------------------------------------------
 
-static enum TokKind tok_text_to_kind(const char *text) {
-    static struct TextTokKind table[] = {
-        {"let", tok_let},       {"if", tok_if},       {"else", tok_else},
-        {"while", tok_while},   {"break", tok_break}, {"fun", tok_fun},
-        {"return", tok_return},
+// 識別子をシンボルリストに登録して、シンボル番号を返す。
+// 文字列を複製するのは、初めて現れた綴りに対してだけ。
+static int sym_intern(Ctx *ctx, int src_l, int src_r) {
+    const char *text = ctx->src + src_l;
+    int len = src_r - src_l;
+
+    int sym_i = str_map_find(&ctx->sym_map, text, len);
+    if (sym_i >= 0) {
+        return sym_i;
+    }
+
+    vec_grow((void **)&ctx->syms.data, ctx->syms.len, &ctx->syms.capacity,
+             sizeof(Sym), 1);
+
+    const char *sym_text = src_slice(ctx, src_l, src_r);
+    sym_i = ctx->syms.len++;
+    ctx->syms.data[sym_i] = (Sym){
+        .text = sym_text,
+        .len = len,
+        .local_i = -1,
     };
 
-    for (int i = 0; i < array_len(table); i++) {
-        if (strcmp(table[i].text, text) == 0) {
-            return table[i].kind;
-        }
+    str_map_insert(&ctx->sym_map, sym_text, len, sym_i);
+    return sym_i;
+}
+
+static Sym *sym_get(Ctx *ctx, int sym_i) {
+    assert(0 <= sym_i && sym_i < ctx->syms.len);
+    return &ctx->syms.data[sym_i];
+}
+
+static const char *sym_text(Ctx *ctx, int sym_i) {
+    return sym_get(ctx, sym_i)->text;
+}
+
+// 識別子トークンのシンボル番号を取得する。
+static int tok_sym(Ctx *ctx, int tok_i) {
+    struct Tok *tok = tok_get(ctx, tok_i);
+    assert(tok->kind == tok_ident && tok->sym_i >= 0);
+    return tok->sym_i;
+}
+
+// 識別子トークンの文字列を取得する。同じ綴りなら同じポインタを返す。
+static const char *tok_ident_text(Ctx *ctx, int tok_i) {
+    return sym_text(ctx, tok_sym(ctx, tok_i));
+}
+
+// 整数トークンの値を取得する。
+static int tok_int_value(Ctx *ctx, int tok_i) {
+    struct Tok *tok = tok_get(ctx, tok_i);
+    assert(tok->kind == tok_int);
+
+    int value = 0;
+    for (int i = tok->src_l; i < tok->src_r; i++) {
+        value = value * 10 + (ctx->src[i] - '0');
     }
-    return tok_ident;
+    return value;
 }
 
 // -----------------------------------------------
@@ -258,9 +339,11 @@ static void tokenize(Ctx *ctx) {
                 r++;
             }
 
-            const char *text = src_slice(ctx, l, r);
-            enum TokKind kind = tok_text_to_kind(text);
-            tok_add(ctx, kind, l, r);
+            enum TokKind kind = tok_keyword_kind(ctx->src + l, r - l);
+            int tok_i = tok_add(ctx, kind, l, r);
+            if (kind == tok_ident) {
+                ctx->toks.data[tok_i].sym_i = sym_intern(ctx, l, r);
+            }
             continue;
         }
 
@@ -525,8 +608,7 @@ static int parse_char(Ctx *ctx, int *tok_i) {
 
     char c = '\0';
     if (tok->src_l + 1 < tok->src_r - 1) {
-        const char *text = src_slice(ctx, tok->src_l + 1, tok->src_r - 1);
-        c = unescape(text);
+        c = unescape(ctx->src + tok->src_l + 1);
     }
 
     return exp_add_int(ctx, exp_int, (int)c, bump(tok_i));
@@ -623,7 +705,7 @@ static int parse_atom(Ctx *ctx, int *tok_i) {
     case tok_eof:
         return exp_add_err(ctx, "式が必要です。", *tok_i);
     case tok_int: {
-        int value = atol(tok_text(ctx, *tok_i));
+        int value = tok_int_value(ctx, *tok_i);
         return exp_add_int(ctx, exp_int, value, bump(tok_i));
     }
     case tok_char:
@@ -631,7 +713,7 @@ static int parse_atom(Ctx *ctx, int *tok_i) {
     case tok_str:
         return parse_str(ctx, tok_i);
     case tok_ident: {
-        const char *text = tok_text(ctx, *tok_i);
+        const char *text = tok_ident_text(ctx, *tok_i);
         return exp_add_str(ctx, exp_ident, text, bump(tok_i));
     }
     case tok_paren_l: {
@@ -964,15 +1046,327 @@ static void parse(Ctx *ctx) {
     int exp_i = exp_add_err(ctx, "NOT AN EXPRESSION", 0);
     assert(exp_i == exp_i_none);
 
-    int fake_tok_i = 0;
-    ctx->exp_i_true = exp_add_int(ctx, exp_int, 1, fake_tok_i);
-    ctx->exp_i_false = exp_add_int(ctx, exp_int, 0, fake_tok_i);
-
     int tok_i = 0;
     ctx->exp_i_root = parse_semi(ctx, &tok_i);
     parse_eof(ctx, &tok_i);
 }
 
+// ###############################################
+// 最適化
+// ###############################################
+
+// 構文木を、実行結果を変えない範囲で単純なものに書き換える。
+// - 定数だけからなる整数や文字列の演算を、計算済みの定数に置き換える。
+// - x + 0 や x * 1 などを x に置き換える。(x が整数になると分かる場合のみ)
+// - 条件が定数の if や &&, || から、実行されない方の分岐を取り除く。
+// - 条件が偽の定数である while を取り除く。
+// 取り除かれる部分で変数が宣言されているなら、変数の有効範囲が変わらないように残す。
+
+static void opt_exp(Ctx *ctx, int exp_i);
+
+// 式を整数定数に置き換える。
+static void opt_set_int(Ctx *ctx, int exp_i, int value) {
+    Exp *exp = exp_get(ctx, exp_i);
+    int tok_i = exp->tok_i;
+    *exp = (Exp){
+        .kind = exp_int,
+        .int_value = value,
+        .tok_i = tok_i,
+    };
+}
+
+// 式を別の式で置き換える。置き換えられた部分式はどこからも参照されなくなる。
+static void opt_replace(Ctx *ctx, int exp_i, int new_exp_i) {
+    if (exp_i != new_exp_i) {
+        *exp_get(ctx, exp_i) = *exp_get(ctx, new_exp_i);
+    }
+}
+
+static bool opt_is_int(Ctx *ctx, int exp_i, int value) {
+    Exp *exp = exp_get(ctx, exp_i);
+    return exp->kind == exp_int && exp->int_value == value;
+}
+
+// 式の値が (評価に成功したなら) 必ず整数になるか。
+static bool opt_yields_int(Ctx *ctx, int exp_i) {
+    Exp *exp = exp_get(ctx, exp_i);
+    if (exp->kind == exp_int) {
+        return true;
+    }
+    if (exp->kind != exp_op) {
+        return false;
+    }
+
+    switch ((OpKind)exp->int_value) {
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_mod:
+    case op_eq:
+    case op_ne:
+    case op_lt:
+    case op_le:
+    case op_gt:
+    case op_ge:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 式が (関数の本体を除いて) 変数を宣言しているか。
+static bool opt_declares_local(Ctx *ctx, int exp_i) {
+    Exp *exp = exp_get(ctx, exp_i);
+
+    switch (exp->kind) {
+    case exp_let:
+        return true;
+    case exp_fun:
+        return false;
+    default:
+        break;
+    }
+
+    if ((exp->exp_cond != exp_i_none &&
+         opt_declares_local(ctx, exp->exp_cond)) ||
+        (exp->exp_l != exp_i_none && opt_declares_local(ctx, exp->exp_l)) ||
+        (exp->exp_r != exp_i_none && opt_declares_local(ctx, exp->exp_r))) {
+        return true;
+    }
+    for (int i = exp->subexp_l; i < exp->subexp_r; i++) {
+        if (opt_declares_local(ctx, subexp_get(ctx, i)->exp_i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 整数どうしの演算を計算する。実行時エラーになる演算なら false を返す。
+static bool opt_fold_int(OpKind op, int l, int r, int *value) {
+    // オーバーフローしたときは 2 の補数で循環させる。
+    unsigned ul = (unsigned)l;
+    unsigned ur = (unsigned)r;
+
+    switch (op) {
+    case op_add:
+        *value = (int)(ul + ur);
+        return true;
+    case op_sub:
+        *value = (int)(ul - ur);
+        return true;
+    case op_mul:
+        *value = (int)(ul * ur);
+        return true;
+    case op_div:
+    case op_mod:
+        if (r == 0 || (l == INT32_MIN && r == -1)) {
+            return false;
+        }
+        *value = op == op_div ? l / r : l % r;
+        return true;
+    case op_eq:
+        *value = l == r;
+        return true;
+    case op_ne:
+        *value = l != r;
+        return true;
+    case op_lt:
+        *value = l < r;
+        return true;
+    case op_le:
+        *value = l <= r;
+        return true;
+    case op_gt:
+        *value = l > r;
+        return true;
+    case op_ge:
+        *value = l >= r;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// 文字列どうしの比較を計算する。
+static bool opt_fold_str_cmp(OpKind op, const char *l, const char *r,
+                             int *value) {
+    int cmp = strcmp(l, r);
+
+    switch (op) {
+    case op_eq:
+        *value = cmp == 0;
+        return true;
+    case op_ne:
+        *value = cmp != 0;
+        return true;
+    case op_lt:
+        *value = cmp < 0;
+        return true;
+    case op_le:
+        *value = cmp <= 0;
+        return true;
+    case op_gt:
+        *value = cmp > 0;
+        return true;
+    case op_ge:
+        *value = cmp >= 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void opt_op(Ctx *ctx, int exp_i) {
+    Exp *exp = exp_get(ctx, exp_i);
+    assert(exp->kind == exp_op);
+    OpKind op = exp->int_value;
+    int exp_l = exp->exp_l;
+    int exp_r = exp->exp_r;
+
+    Exp *l = exp_get(ctx, exp_l);
+    Exp *r = exp_get(ctx, exp_r);
+
+    // 定数; r ---> r
+    if (op == op_semi && (l->kind == exp_int || l->kind == exp_str)) {
+        opt_replace(ctx, exp_i, exp_r);
+        return;
+    }
+
+    // 条件が定数の && と || は、どちらかの辺になる。
+    if ((op == op_log_and || op == op_log_or) && l->kind == exp_int &&
+        !opt_declares_local(ctx, exp_r)) {
+        bool cond = l->int_value != 0;
+        if (op == op_log_and) {
+            cond ? opt_replace(ctx, exp_i, exp_r) : opt_set_int(ctx, exp_i, 0);
+        } else {
+            cond ? opt_set_int(ctx, exp_i, 1) : opt_replace(ctx, exp_i, exp_r);
+        }
+        return;
+    }
+
+    int value;
+    if (l->kind == exp_int && r->kind == exp_int) {
+        if (opt_fold_int(op, l->int_value, r->int_value, &value)) {
+            opt_set_int(ctx, exp_i, value);
+        }
+        return;
+    }
+
+    if (l->kind == exp_str && r->kind == exp_str) {
+        if (op == op_add) {
+            int l_len = strlen(l->str_value);
+            int r_len = strlen(r->str_value);
+            char *str = mem_alloc(l_len + r_len + 1, sizeof(char));
+            memcpy(str, l->str_value, l_len);
+            memcpy(str + l_len, r->str_value, r_len + 1);
+
+            // 畳み込んだ文字列は外側の畳み込みからも読まれるので、まだ解放しない。
+            vec_grow((void **)&ctx->opt_strs, ctx->opt_str_len,
+                     &ctx->opt_str_capacity, sizeof(char *), 1);
+            ctx->opt_strs[ctx->opt_str_len++] = str;
+
+            int tok_i = exp->tok_i;
+            *exp = (Exp){
+                .kind = exp_str,
+                .str_value = str,
+                .tok_i = tok_i,
+            };
+            return;
+        }
+        if (opt_fold_str_cmp(op, l->str_value, r->str_value, &value)) {
+            opt_set_int(ctx, exp_i, value);
+        }
+        return;
+    }
+
+    // 型の異なる定数の比較
+    bool l_const = l->kind == exp_int || l->kind == exp_str;
+    bool r_const = r->kind == exp_int || r->kind == exp_str;
+    if (l_const && r_const && (op == op_eq || op == op_ne)) {
+        opt_set_int(ctx, exp_i, op == op_ne);
+        return;
+    }
+
+    // 単位元との演算。(x が整数でなければ型エラーになるので、残しておく。)
+    if (opt_yields_int(ctx, exp_l) &&
+        (((op == op_add || op == op_sub) && opt_is_int(ctx, exp_r, 0)) ||
+         ((op == op_mul || op == op_div) && opt_is_int(ctx, exp_r, 1)))) {
+        opt_replace(ctx, exp_i, exp_l);
+        return;
+    }
+    if (opt_yields_int(ctx, exp_r) &&
+        ((op == op_add && opt_is_int(ctx, exp_l, 0)) ||
+         (op == op_mul && opt_is_int(ctx, exp_l, 1)))) {
+        opt_replace(ctx, exp_i, exp_r);
+        return;
+    }
+}
+
+static void opt_if(Ctx *ctx, int exp_i) {
+    Exp *exp = exp_get(ctx, exp_i);
+    assert(exp->kind == exp_if);
+
+    Exp *cond = exp_get(ctx, exp->exp_cond);
+    if (cond->kind != exp_int) {
+        return;
+    }
+
+    int taken = cond->int_value != 0 ? exp->exp_l : exp->exp_r;
+    int dropped = cond->int_value != 0 ? exp->exp_r : exp->exp_l;
+    if (opt_declares_local(ctx, dropped)) {
+        return;
+    }
+    opt_replace(ctx, exp_i, taken);
+}
+
+static void opt_while(Ctx *ctx, int exp_i) {
+    Exp *exp = exp_get(ctx, exp_i);
+    assert(exp->kind == exp_while);
+
+    // while の値は null
+    if (opt_is_int(ctx, exp->exp_cond, 0) &&
+        !opt_declares_local(ctx, exp->exp_l)) {
+        opt_set_int(ctx, exp_i, 0);
+    }
+}
+
+// 部分式を先に最適化してから、式自体を最適化する。
+static void opt_exp(Ctx *ctx, int exp_i) {
+    if (exp_i == exp_i_none) {
+        return;
+    }
+
+    Exp *exp = exp_get(ctx, exp_i);
+    int exp_cond = exp->exp_cond;
+    int exp_l = exp->exp_l;
+    int exp_r = exp->exp_r;
+    int subexp_l = exp->subexp_l;
+    int subexp_r = exp->subexp_r;
+
+    opt_exp(ctx, exp_cond);
+    opt_exp(ctx, exp_l);
+    opt_exp(ctx, exp_r);
+    for (int i = subexp_l; i < subexp_r; i++) {
+        opt_exp(ctx, subexp_get(ctx, i)->exp_i);
+    }
+
+    switch (exp_get(ctx, exp_i)->kind) {
+    case exp_op:
+        opt_op(ctx, exp_i);
+        return;
+    case exp_if:
+        opt_if(ctx, exp_i);
+        return;
+    case exp_while:
+        opt_while(ctx, exp_i);
+        return;
+    default:
+        return;
+    }
+}
+
+static void optimize(Ctx *ctx) { opt_exp(ctx, ctx->exp_i_root); }
+
 // ###############################################
 // コード生成
 // ###############################################
@@ -981,20 +1375,41 @@ static void parse(Ctx *ctx) {
 // データ領域
 // -----------------------------------------------
 
+// 定数を追加して、その定数番号を返す。同じ内容の定数がすでにあれば、それを返す。
 static int data_new(Ctx *ctx, const char *message) {
     assert(strstr(message, "\n\n") == NULL);
 
-    int data_i = ctx->data->size;
+    int len = strlen(message);
+    int const_i = str_map_find(&ctx->const_map, message, len);
+    if (const_i >= 0) {
+        return const_i;
+    }
+
+    int offset = ctx->data->size;
     sb_append(ctx->data, message);
     sb_append(ctx->data, "\n\n");
 
-    return data_i;
+    vec_grow((void **)&ctx->consts.data, ctx->consts.len, &ctx->consts.capacity,
+             sizeof(Const), 1);
+    const_i = ctx->consts.len++;
+    ctx->consts.data[const_i] = (Const){
+        .offset = offset,
+        .len = len,
+    };
+
+    str_map_insert(&ctx->const_map, string_slice(message, 0, len), len,
+                   const_i);
+    return const_i;
+}
+
+static const Const *data_const_get(Ctx *ctx, int const_i) {
+    assert(0 <= const_i && const_i < ctx->consts.len);
+    return &ctx->consts.data[const_i];
 }
 
-static const char *data_get(Ctx *ctx, int data_i) {
-    char *p = ctx->data->data + data_i;
-    char *q = strstr(p, "\n\n");
-    return string_slice(p, 0, q - p);
+static const char *data_get(Ctx *ctx, int const_i) {
+    const Const *c = data_const_get(ctx, const_i);
+    return string_slice(ctx->data->data, c->offset, c->offset + c->len);
 }
 
 // -----------------------------------------------
@@ -1026,6 +1441,97 @@ static bool op_is_set_op(OpKind op) {
     return op_find_op_by_set_op(op, &result);
 }
 
+static bool op_is_cmp(OpKind op) {
+    return op == op_eq || op == op_ne || op == op_lt || op == op_le ||
+           op == op_gt || op == op_ge;
+}
+
+// !(l op r) を表す比較
+static OpKind op_cmp_negate(OpKind op) {
+    switch (op) {
+    case op_eq:
+        return op_ne;
+    case op_ne:
+        return op_eq;
+    case op_lt:
+        return op_ge;
+    case op_le:
+        return op_gt;
+    case op_gt:
+        return op_le;
+    case op_ge:
+        return op_lt;
+    default:
+        failwith("Not a comparison");
+    }
+}
+
+// 比較が成り立つときにジャンプする命令
+static CmdKind op_cmp_jump_kind(OpKind op) {
+    switch (op) {
+    case op_eq:
+        return cmd_jump_if_eq;
+    case op_ne:
+        return cmd_jump_if_ne;
+    case op_lt:
+        return cmd_jump_if_lt;
+    case op_le:
+        return cmd_jump_if_le;
+    case op_gt:
+        return cmd_jump_if_gt;
+    case op_ge:
+        return cmd_jump_if_ge;
+    default:
+        failwith("Not a comparison");
+    }
+}
+
+// 整数どうしの演算に特殊化した命令 (なければ cmd_op)
+static CmdKind op_int_cmd_kind(OpKind op) {
+    switch (op) {
+    case op_add:
+        return cmd_op_add_int;
+    case op_sub:
+        return cmd_op_sub_int;
+    case op_mul:
+        return cmd_op_mul_int;
+    case op_eq:
+        return cmd_op_eq_int;
+    case op_ne:
+        return cmd_op_ne_int;
+    case op_lt:
+        return cmd_op_lt_int;
+    case op_le:
+        return cmd_op_le_int;
+    case op_gt:
+        return cmd_op_gt_int;
+    case op_ge:
+        return cmd_op_ge_int;
+    default:
+        return cmd_op;
+    }
+}
+
+// 比較してジャンプする命令が行う比較
+static OpKind cmd_jump_cmp_op(CmdKind kind) {
+    switch (kind) {
+    case cmd_jump_if_eq:
+        return op_eq;
+    case cmd_jump_if_ne:
+        return op_ne;
+    case cmd_jump_if_lt:
+        return op_lt;
+    case cmd_jump_if_le:
+        return op_le;
+    case cmd_jump_if_gt:
+        return op_gt;
+    case cmd_jump_if_ge:
+        return op_ge;
+    default:
+        failwith("Not a compare-and-jump");
+    }
+}
+
 // -----------------------------------------------
 // ラベルリスト
 // -----------------------------------------------
@@ -1059,10 +1565,14 @@ static int scope_add(Ctx *ctx, int parent, int tok_i) {
     vec_grow((void **)&ctx->scopes.data, ctx->scopes.len, &ctx->scopes.capacity,
              sizeof(Scope), 1);
 
+    int depth = parent < 0 ? 0 : ctx->scopes.data[parent].depth + 1;
+
     int scope_i = ctx->scopes.len++;
     ctx->scopes.data[scope_i] = (Scope){
         .parent = parent,
         .tok_i = tok_i,
+        .depth = depth,
+        .binding_len = ctx->bindings.len,
     };
     return scope_i;
 }
@@ -1081,9 +1591,16 @@ static void scope_push(Ctx *ctx, int tok_i) {
     ctx->scope_i_current = scope_i;
 }
 
+// スコープを抜ける。このスコープで束縛された名前は、外側の束縛に戻す。
 static void scope_pop(Ctx *ctx) {
     Scope *scope = scope_get(ctx, ctx->scope_i_current);
 
+    while (ctx->bindings.len > scope->binding_len) {
+        int local_i = ctx->bindings.data[--ctx->bindings.len];
+        Local *local = &ctx->locals.data[local_i];
+        sym_get(ctx, local->sym_i)->local_i = local->shadowed_local_i;
+    }
+
     assert(scope->parent >= 0);
     ctx->scope_i_current = scope->parent;
 }
@@ -1092,19 +1609,34 @@ static void scope_pop(Ctx *ctx) {
 // ローカルリスト
 // -----------------------------------------------
 
-static int local_add(Ctx *ctx, const char *ident, int scope_i, int tok_i) {
+// ローカルを追加して、シンボルをそのローカルに束縛する。
+// ただし、同じスコープですでに束縛されている名前は、最初のローカルを指したままにする。
+static int local_add(Ctx *ctx, int sym_i, int scope_i, int tok_i) {
     vec_grow((void **)&ctx->locals.data, ctx->locals.len, &ctx->locals.capacity,
              sizeof(Local), 1);
 
     int index = scope_get(ctx, scope_i)->len++;
 
+    Sym *sym = sym_get(ctx, sym_i);
+    int shadowed_local_i = sym->local_i;
+
     int local_i = ctx->locals.len++;
     ctx->locals.data[local_i] = (Local){
-        .ident = ident,
+        .ident = sym->text,
         .scope_i = scope_i,
         .index = index,
         .tok_i = tok_i,
+        .sym_i = sym_i,
+        .shadowed_local_i = shadowed_local_i,
     };
+
+    if (shadowed_local_i >= 0 &&
+        ctx->locals.data[shadowed_local_i].scope_i == scope_i) {
+        return local_i;
+    }
+
+    sym->local_i = local_i;
+    vec_int_push(&ctx->bindings, local_i);
     return local_i;
 }
 
@@ -1113,38 +1645,94 @@ static Local *local_get(Ctx *ctx, int local_i) {
     return &ctx->locals.data[local_i];
 }
 
-static int local_add_var(Ctx *ctx, const char *ident, int tok_i) {
-    return local_add(ctx, ident, ctx->scope_i_current, tok_i);
+// 識別子トークンが表す名前のローカル変数を、現在のスコープに追加する。
+static int local_add_var(Ctx *ctx, int tok_i) {
+    return local_add(ctx, tok_sym(ctx, tok_i), ctx->scope_i_current, tok_i);
 }
 
-// ローカル変数を探索する。
+// 識別子トークンが表す名前のローカル変数を探索する。
+// シンボルの束縛を見るだけなので、ローカルやスコープの個数によらない時間で済む。
 // local_i: 発見されたローカル番号
 // level: 発見されたローカル変数が、何個外側の関数スコープにあるのか
-static bool local_find_var(Ctx *ctx, const char *ident, int tok_i, int *local_i,
-                           int *level) {
-    int scope_i = ctx->scope_i_current;
-    *level = 0;
-    while (true) {
-        for (int i = 0; i < ctx->locals.len; i++) {
-            Local *local = local_get(ctx, i);
-            if (local->scope_i != scope_i) {
-                continue;
-            }
-            if (strcmp(local->ident, ident) != 0) {
-                continue;
-            }
-            *local_i = i;
-            return true;
+static bool local_find_var(Ctx *ctx, int tok_i, int *local_i, int *level) {
+    int found = sym_get(ctx, tok_sym(ctx, tok_i))->local_i;
+    if (found < 0) {
+        return false;
+    }
+
+    // 束縛が残っているローカルは、現在のスコープかその祖先に属している。
+    const Scope *scope = scope_get(ctx, local_get(ctx, found)->scope_i);
+    *local_i = found;
+    *level = scope_get(ctx, ctx->scope_i_current)->depth - scope->depth;
+    assert(*level >= 0);
+    return true;
+}
+
+// -----------------------------------------------
+// 捕獲変数リスト
+// -----------------------------------------------
+
+static Fun *fun_get(Ctx *ctx, int fun_i);
+
+static void upval_push(VecUpval *upvals, Upval upval) {
+    vec_grow((void **)&upvals->data, upvals->len, &upvals->capacity,
+             sizeof(Upval), 1);
+    upvals->data[upvals->len++] = upval;
+}
+
+// スコープ scope_i の関数が、外側の関数のローカル変数 local_i を捕獲する。
+// 捕獲変数の番号を返す。間にある関数にも、必要なら捕獲変数を追加する。
+static int upval_resolve(Ctx *ctx, int scope_i, int local_i) {
+    int index = 0;
+    for (int i = 0; i < ctx->upvals_gen.len; i++) {
+        const Upval *upval = &ctx->upvals_gen.data[i];
+        if (upval->scope_i != scope_i) {
+            continue;
         }
+        if (upval->local_i == local_i) {
+            return index;
+        }
+        index++;
+    }
 
-        Scope *scope = scope_get(ctx, scope_i);
-        assert(scope_i != scope->parent);
-        if (scope->parent < 0) {
-            return false;
+    int parent = scope_get(ctx, scope_i)->parent;
+    const Local *local = local_get(ctx, local_i);
+    bool from_local = local->scope_i == parent;
+
+    int parent_index;
+    if (from_local) {
+        parent_index = local->index;
+        scope_get(ctx, parent)->captured = true;
+    } else {
+        parent_index = upval_resolve(ctx, parent, local_i);
+    }
+
+    upval_push(&ctx->upvals_gen, (Upval){
+                                     .scope_i = scope_i,
+                                     .local_i = local_i,
+                                     .from_local = from_local,
+                                     .index = parent_index,
+                                 });
+    return index;
+}
+
+// コード生成を終えた関数の捕獲変数を、関数ごとのリストに移す。
+static void upval_finish(Ctx *ctx, int fun_i) {
+    Fun *fun = fun_get(ctx, fun_i);
+    fun->upval_l = ctx->upvals.len;
+
+    int len = 0;
+    for (int i = 0; i < ctx->upvals_gen.len; i++) {
+        Upval upval = ctx->upvals_gen.data[i];
+        if (upval.scope_i == fun->scope_i) {
+            upval_push(&ctx->upvals, upval);
+            continue;
         }
-        scope_i = scope->parent;
-        (*level)++;
+        ctx->upvals_gen.data[len++] = upval;
     }
+    ctx->upvals_gen.len = len;
+
+    fun->upval_len = ctx->upvals.len - fun->upval_l;
 }
 
 // -----------------------------------------------
@@ -1184,30 +1772,47 @@ static int fun_add_closure(Ctx *ctx, int scope_i, int label_i) {
 // 外部関数リスト
 // -----------------------------------------------
 
-static int extern_fun_add(Ctx *ctx, const char *name, extern_fun_t fun) {
-    vec_grow((void **)&ctx->extern_funs.data, ctx->extern_funs.len,
-             &ctx->extern_funs.capacity, sizeof(ExternFun), 1);
-
-    int extern_fun_i = ctx->extern_funs.len++;
-    ctx->extern_funs.data[extern_fun_i] = (ExternFun){
-        .name = name,
-        .fun = fun,
-    };
-    return extern_fun_i;
+// 組み込み関数の表は「組み込み関数」の節で定義する。
+static int builtin_len();
+static const ExternFun *builtin_get(int builtin_i);
+static int builtin_find(const char *name, int len);
+static CmdKind builtin_intrinsic_kind(const ExternFun *extern_fun);
+
+// 外部関数の個数 (組み込み関数と登録簿の関数の合計)
+static int extern_fun_len(Ctx *ctx) {
+    int len = builtin_len();
+    if (ctx->registry != NULL) {
+        len += ctx->registry->funs.len;
+    }
+    return len;
 }
 
-static ExternFun *extern_fun_get(Ctx *ctx, int extern_fun_i) {
-    assert(0 <= extern_fun_i && extern_fun_i < ctx->extern_funs.len);
-    return &ctx->extern_funs.data[extern_fun_i];
+static const ExternFun *extern_fun_get(Ctx *ctx, int extern_fun_i) {
+    assert(0 <= extern_fun_i && extern_fun_i < extern_fun_len(ctx));
+
+    if (extern_fun_i < builtin_len()) {
+        return builtin_get(extern_fun_i);
+    }
+    return &ctx->registry->funs.data[extern_fun_i - builtin_len()];
 }
 
+// 名前から外部関数を探す。登録簿の関数を組み込み関数より優先する。
 static bool extern_fun_find(Ctx *ctx, const char *name, int *extern_fun_i) {
-    for (int i = 0; i < ctx->extern_funs.len; i++) {
-        if (strcmp(ctx->extern_funs.data[i].name, name) == 0) {
-            *extern_fun_i = i;
+    int len = strlen(name);
+
+    if (ctx->registry != NULL) {
+        int i = str_map_find(&ctx->registry->map, name, len);
+        if (i >= 0) {
+            *extern_fun_i = builtin_len() + i;
             return true;
         }
     }
+
+    int builtin_i = builtin_find(name, len);
+    if (builtin_i >= 0) {
+        *extern_fun_i = builtin_i;
+        return true;
+    }
     return false;
 }
 
@@ -1290,9 +1895,30 @@ static void cmd_add_closure(Ctx *ctx, int fun_i, int tok_i) {
     cmd_add_int(ctx, cmd_push_closure, fun_i, tok_i);
 }
 
-static void cmd_add_local_var(Ctx *ctx, int index, int level, int tok_i) {
-    cmd_add_int(ctx, cmd_push_env, level, tok_i);
-    cmd_add_int(ctx, cmd_local_var, index, tok_i);
+
+static void cmd_add_xy(Ctx *ctx, CmdKind kind, int x, int y, int tok_i) {
+    cmd_do_add(ctx, (Cmd){
+                        .kind = kind,
+                        .x = x,
+                        .y = y,
+                        .tok_i = tok_i,
+                    });
+}
+
+// 変数を読み書きする命令を追加する。
+// グローバル変数の読み書きには、セルを直接指す命令を使う。
+static void cmd_add_local(Ctx *ctx, CmdKind kind, int index, int var_kind,
+                          int tok_i) {
+    if (var_kind == var_global && kind == cmd_load_local) {
+        cmd_add_int(ctx, cmd_load_global, index, tok_i);
+        return;
+    }
+    if (var_kind == var_global && kind == cmd_store_local) {
+        cmd_add_int(ctx, cmd_store_global, index, tok_i);
+        return;
+    }
+
+    cmd_add_xy(ctx, kind, index, var_kind, tok_i);
 }
 
 static void cmd_add_op(Ctx *ctx, OpKind op, int tok_i) {
@@ -1309,6 +1935,11 @@ static void cmd_add_jump_unless(Ctx *ctx, int label_i, int tok_i) {
     cmd_add_int(ctx, cmd_jump_unless, label_i, tok_i);
 }
 
+static void cmd_add_jump_if(Ctx *ctx, int label_i, int tok_i) {
+    assert(0 <= label_i && label_i < ctx->labels.len);
+    cmd_add_int(ctx, cmd_jump_if, label_i, tok_i);
+}
+
 static void cmd_add_null(Ctx *ctx, int tok_i) {
     cmd_add_int(ctx, cmd_push_int, 0, tok_i);
 }
@@ -1319,10 +1950,26 @@ static void cmd_add_negate(Ctx *ctx, int tok_i) {
     cmd_add_op(ctx, op_eq, tok_i);
 }
 
-// goto l ---> null; jump_unless l
 static void cmd_add_goto(Ctx *ctx, int label_i, int tok_i) {
-    cmd_add_null(ctx, tok_i);
-    cmd_add_jump_unless(ctx, label_i, tok_i);
+    assert(0 <= label_i && label_i < ctx->labels.len);
+    cmd_add_int(ctx, cmd_jump, label_i, tok_i);
+}
+
+// 関数から戻る命令を追加する。
+// 直前の命令が関数呼び出しなら、末尾呼び出しに置き換える。
+static void cmd_add_return(Ctx *ctx, int tok_i) {
+    // トップレベルのフレームはグローバル環境を持つので、置き換えてはいけない。
+    bool in_fun = ctx->scope_i_current != ctx->scope_i_global;
+
+    if (in_fun && ctx->cmds.len >= 1) {
+        Cmd *last = &ctx->cmds.data[ctx->cmds.len - 1];
+        if (last->kind == cmd_call) {
+            last->kind = cmd_tail_call;
+            return;
+        }
+    }
+
+    cmd_add(ctx, cmd_return, tok_i);
 }
 
 // -----------------------------------------------
@@ -1336,23 +1983,67 @@ static void gen_exp(Ctx *ctx, int exp_i);
 
 static void gen_lval(Ctx *ctx, int exp_i);
 
-static void gen_log_or(Ctx *ctx, int exp_i);
-
-static void gen_log_and(Ctx *ctx, int exp_i);
+static void gen_log_op(Ctx *ctx, int exp_i);
 
-static void gen_ident(Ctx *ctx, int exp_i, bool lval) {
+// 式がローカル変数を指す識別子なら、その変数の位置を取得する。
+// 外側の関数のローカル変数なら、捕獲変数として参照する。
+// var_kind: 変数の置き場所 (VarKind)
+static bool gen_find_local(Ctx *ctx, int exp_i, int *index, int *var_kind) {
     defexp;
-    assert(exp->kind == exp_ident);
-    const char *name = exp->str_value;
-    int tok_i = exp->tok_i;
+    if (exp->kind != exp_ident) {
+        return false;
+    }
 
     int local_i, level;
-    if (local_find_var(ctx, name, tok_i, &local_i, &level)) {
-        Local *local = local_get(ctx, local_i);
-        cmd_add_local_var(ctx, local->index, level, tok_i);
+    if (!local_find_var(ctx, exp->tok_i, &local_i, &level)) {
+        return false;
+    }
 
-        if (!lval) {
-            cmd_add(ctx, cmd_cell_get, tok_i);
+    const Local *local = local_get(ctx, local_i);
+    if (local->scope_i == ctx->scope_i_global) {
+        *index = local->index;
+        *var_kind = var_global;
+        return true;
+    }
+
+    if (level == 0) {
+        *index = local->index;
+        *var_kind = var_local;
+        return true;
+    }
+
+    *index = upval_resolve(ctx, ctx->scope_i_current, local_i);
+    *var_kind = var_upval;
+    return true;
+}
+
+// 式が外部関数を指す識別子なら、その外部関数番号を得る。
+static bool gen_find_extern(Ctx *ctx, int exp_i, int *extern_fun_i) {
+    defexp;
+    if (exp->kind != exp_ident) {
+        return false;
+    }
+
+    int index, var_kind;
+    if (gen_find_local(ctx, exp_i, &index, &var_kind)) {
+        return false;
+    }
+
+    return extern_fun_find(ctx, exp->str_value, extern_fun_i);
+}
+
+static void gen_ident(Ctx *ctx, int exp_i, bool lval) {
+    defexp;
+    assert(exp->kind == exp_ident);
+    const char *name = exp->str_value;
+    int tok_i = exp->tok_i;
+
+    int index, var_kind;
+    if (gen_find_local(ctx, exp_i, &index, &var_kind)) {
+        if (lval) {
+            cmd_add_local(ctx, cmd_local_ref, index, var_kind, tok_i);
+        } else {
+            cmd_add_local(ctx, cmd_load_local, index, var_kind, tok_i);
         }
         return;
     }
@@ -1387,18 +2078,72 @@ static void gen_call(Ctx *ctx, int exp_i) {
     int len = exp->subexp_r - exp->subexp_l;
     int tok_i = exp->tok_i;
 
-    gen_exp(ctx, exp->exp_l);
+    // 外部関数の呼び出しなら、関数を命令に埋め込む。
+    int extern_fun_i;
+    bool is_extern = gen_find_extern(ctx, exp->exp_l, &extern_fun_i);
+
+    if (!is_extern) {
+        gen_exp(ctx, exp->exp_l);
+    }
     for (int i = exp->subexp_l; i < exp->subexp_r; i++) {
         gen_exp(ctx, subexp_get(ctx, i)->exp_i);
     }
+
+    if (is_extern) {
+        // 引数の個数は、外部関数に束縛する時点で検査する。
+        int arity = extern_fun_get(ctx, extern_fun_i)->arity;
+        if (arity >= 0 && len != arity) {
+            cmd_add_err(ctx, "引数の個数が一致しません。", tok_i);
+            return;
+        }
+
+        // 組み込み関数は、専用の命令で実行する。
+        CmdKind kind =
+            builtin_intrinsic_kind(extern_fun_get(ctx, extern_fun_i));
+        if (kind != cmd_call_extern) {
+            cmd_add(ctx, kind, tok_i);
+            return;
+        }
+
+        cmd_add_xy(ctx, cmd_call_extern, len, extern_fun_i, tok_i);
+        return;
+    }
     cmd_add_int(ctx, cmd_call, len, tok_i);
 }
 
+// 左辺が配列の要素なら、配列、要素番号、右辺の順に積んで設定する。
+// op: op_set なら代入、そうでなければ複合代入の演算子
+static bool gen_index_set(Ctx *ctx, int l_exp_i, int r_exp_i, OpKind op) {
+    const Exp *l_exp = exp_get(ctx, l_exp_i);
+    if (l_exp->kind != exp_op || (OpKind)l_exp->int_value != op_index) {
+        return false;
+    }
+
+    gen_exp(ctx, l_exp->exp_l);
+    gen_exp(ctx, l_exp->exp_r);
+    gen_exp(ctx, r_exp_i);
+    cmd_add_int(ctx, cmd_index_set, op, l_exp->tok_i);
+    return true;
+}
+
 static void gen_set(Ctx *ctx, int exp_i) {
     defexp;
     assert(exp->kind == exp_op);
     assert(exp->int_value == op_set);
 
+    // ローカル変数への代入は参照セルを経由しない。
+    int index, var_kind;
+    if (gen_find_local(ctx, exp->exp_l, &index, &var_kind)) {
+        gen_exp(ctx, exp->exp_r);
+        cmd_add_local(ctx, cmd_store_local, index, var_kind, exp->tok_i);
+        return;
+    }
+
+    // 配列の要素への代入も参照セルを経由しない。
+    if (gen_index_set(ctx, exp->exp_l, exp->exp_r, op_set)) {
+        return;
+    }
+
     gen_lval(ctx, exp->exp_l);
     gen_exp(ctx, exp->exp_r);
     cmd_add(ctx, cmd_cell_set, exp->tok_i);
@@ -1414,6 +2159,26 @@ static void gen_set_op(Ctx *ctx, int exp_i) {
     int ok = op_find_op_by_set_op(set_op, &op);
     assert(ok);
 
+    // ローカル変数への複合代入は参照セルを経由しない。
+    int index, var_kind;
+    if (gen_find_local(ctx, exp->exp_l, &index, &var_kind)) {
+        if (op == op_add) {
+            gen_exp(ctx, exp->exp_r);
+            cmd_add_local(ctx, cmd_inc_local, index, var_kind, tok_i);
+            return;
+        }
+
+        cmd_add_local(ctx, cmd_load_local, index, var_kind, tok_i);
+        gen_exp(ctx, exp->exp_r);
+        cmd_add_op(ctx, op, tok_i);
+        cmd_add_local(ctx, cmd_store_local, index, var_kind, tok_i);
+        return;
+    }
+
+    if (gen_index_set(ctx, exp->exp_l, exp->exp_r, op)) {
+        return;
+    }
+
     gen_lval(ctx, exp->exp_l);
 
     // 左辺の参照セルを複製して値を取り出す。
@@ -1449,12 +2214,8 @@ static void gen_op(Ctx *ctx, int exp_i, bool lval) {
         gen_set_op(ctx, exp_i);
         return;
     }
-    if (op == op_log_or) {
-        gen_log_or(ctx, exp_i);
-        return;
-    }
-    if (op == op_log_and) {
-        gen_log_and(ctx, exp_i);
+    if (op == op_log_or || op == op_log_and) {
+        gen_log_op(ctx, exp_i);
         return;
     }
 
@@ -1521,15 +2282,19 @@ static void gen_fun(Ctx *ctx, int exp_i) {
             continue;
         }
 
-        local_add_var(ctx, param->str_value, param->tok_i);
+        local_add_var(ctx, param->tok_i);
     }
 
     // 関数本体を解析する。
     gen_exp(ctx, body_exp_i);
-    cmd_add(ctx, cmd_return, exp->tok_i);
+    cmd_add_return(ctx, exp->tok_i);
 
     scope_pop(ctx);
     int fun_i = fun_add_closure(ctx, scope_i, body_label_i);
+    upval_finish(ctx, fun_i);
+
+    // ローカル変数が捕獲されなければ、関数の実行が終わった後に参照されることはない。
+    fun_get(ctx, fun_i)->stack_locals = !scope_get(ctx, scope_i)->captured;
 
     cmd_add_label(ctx, next_label_i, exp->tok_i);
     cmd_add_closure(ctx, fun_i, exp->tok_i);
@@ -1539,58 +2304,107 @@ static void gen_let(Ctx *ctx, int exp_i) {
     defexp;
     assert(exp->kind == exp_let);
     int ident_tok_i = exp->int_value;
-    const char *ident = tok_text(ctx, ident_tok_i);
 
     gen_exp(ctx, exp->exp_l);
 
-    int local_i = local_add_var(ctx, ident, ident_tok_i);
+    int local_i = local_add_var(ctx, ident_tok_i);
     Local *local = local_get(ctx, local_i);
-    int level = 0;
+    int var_kind =
+        local->scope_i == ctx->scope_i_global ? var_global : var_local;
 
-    // 右辺の値、左辺の参照セル、という順番でスタックに積む。
-    // 代入式とは逆。swap が必要になる。
-    cmd_add_local_var(ctx, local->index, level, exp->tok_i);
-    cmd_add(ctx, cmd_swap, exp->tok_i);
-    cmd_add(ctx, cmd_cell_set, exp->tok_i);
+    cmd_add_local(ctx, cmd_store_local, local->index, var_kind, exp->tok_i);
+}
+
+// 条件式の真偽が when に一致するときにラベルへジャンプする命令列を生成する。
+// 条件式の値はスタックに残らない。比較や論理演算は、真偽値を積まずに分岐に変換する。
+static void gen_jump_cond(Ctx *ctx, int exp_i, bool when, int label_i) {
+    defexp;
+    int tok_i = exp->tok_i;
+    OpKind op = exp->kind == exp_op ? (OpKind)exp->int_value : op_semi;
+
+    if (op == op_log_and || op == op_log_or) {
+        // && は左辺が偽なら、|| は左辺が真なら、右辺を評価せずに結果が決まる。
+        bool short_when = op == op_log_or;
+
+        if (when == short_when) {
+            // l && r が偽 <=> l が偽、または r が偽
+            gen_jump_cond(ctx, exp->exp_l, when, label_i);
+            gen_jump_cond(ctx, exp->exp_r, when, label_i);
+            return;
+        }
+
+        // l && r が真 <=> l が真、かつ r が真
+        int skip_label_i = label_add(ctx);
+        gen_jump_cond(ctx, exp->exp_l, short_when, skip_label_i);
+        gen_jump_cond(ctx, exp->exp_r, when, label_i);
+        cmd_add_label(ctx, skip_label_i, tok_i);
+        return;
+    }
+
+    if (op_is_cmp(op)) {
+        gen_exp(ctx, exp->exp_l);
+        gen_exp(ctx, exp->exp_r);
+
+        OpKind cmp = when ? op : op_cmp_negate(op);
+        assert(0 <= label_i && label_i < ctx->labels.len);
+        cmd_add_int(ctx, op_cmp_jump_kind(cmp), label_i, tok_i);
+        return;
+    }
+
+    gen_exp(ctx, exp_i);
+    if (when) {
+        cmd_add_jump_if(ctx, label_i, tok_i);
+    } else {
+        cmd_add_jump_unless(ctx, label_i, tok_i);
+    }
 }
 
-static void do_gen_if(Ctx *ctx, int cond_exp_i, int body_exp_i, int alt_exp_i, int tok_i) {
+static void gen_if(Ctx *ctx, int exp_i) {
+    defexp;
+    assert(exp->kind == exp_if);
+    int tok_i = exp->tok_i;
+
     int else_label_i = label_add(ctx);
     int end_label_i = label_add(ctx);
 
-    // do cond; if false, goto l_else
-    gen_exp(ctx, cond_exp_i);
-    cmd_add_jump_unless(ctx, else_label_i, tok_i);
+    // if cond is false, goto l_else
+    gen_jump_cond(ctx, exp->exp_cond, false, else_label_i);
 
     // do then_clause; goto l_end
-    gen_exp(ctx, body_exp_i);
+    gen_exp(ctx, exp->exp_l);
     cmd_add_goto(ctx, end_label_i, tok_i);
 
     // l_else: do else_clause
     cmd_add_label(ctx, else_label_i, tok_i);
-    gen_exp(ctx, alt_exp_i);
+    gen_exp(ctx, exp->exp_r);
 
     // l_end:
     cmd_add_label(ctx, end_label_i, tok_i);
 }
 
-static void gen_if(Ctx *ctx, int exp_i) {
+// l || r ---> if (l) { 1 } else { r }
+// l && r ---> if (l) { r } else { 0 }
+static void gen_log_op(Ctx *ctx, int exp_i) {
     defexp;
-    assert(exp->kind == exp_if);
+    bool is_or = exp->int_value == op_log_or;
+    int tok_i = exp->tok_i;
 
-    do_gen_if(ctx, exp->exp_cond, exp->exp_l, exp->exp_r, exp->tok_i);
-}
+    int short_label_i = label_add(ctx);
+    int end_label_i = label_add(ctx);
 
-static void gen_log_or(Ctx *ctx, int exp_i) {
-    defexp;
+    // if l is true (||) or false (&&), goto l_short
+    gen_jump_cond(ctx, exp->exp_l, is_or, short_label_i);
 
-    do_gen_if(ctx, exp->exp_l, ctx->exp_i_true, exp->exp_r, exp->tok_i);
-}
+    // do r; goto l_end
+    gen_exp(ctx, exp->exp_r);
+    cmd_add_goto(ctx, end_label_i, tok_i);
 
-static void gen_log_and(Ctx *ctx, int exp_i) {
-    defexp;
+    // l_short: push 1 (||) or 0 (&&)
+    cmd_add_label(ctx, short_label_i, tok_i);
+    cmd_add_int(ctx, cmd_push_int, is_or ? 1 : 0, tok_i);
 
-    do_gen_if(ctx, exp->exp_l, exp->exp_r, ctx->exp_i_false, exp->tok_i);
+    // l_end:
+    cmd_add_label(ctx, end_label_i, tok_i);
 }
 
 // スタックに何らかの値をちょうど1つ積んだ状態で終了するように気をつける。
@@ -1601,22 +2415,24 @@ static void gen_while(Ctx *ctx, int exp_i) {
     int body_exp_i = exp->exp_l;
     int tok_i = exp->tok_i;
 
+    int body_label_i = label_add(ctx);
     int continue_label_i = label_add(ctx);
     int break_label_i = label_add(ctx);
 
     loop_push(ctx, break_label_i);
 
-    // l_continue: do cond; if false, break
-    cmd_add_label(ctx, continue_label_i, tok_i);
-
-    gen_exp(ctx, cond_exp_i);
-    cmd_add_jump_unless(ctx, break_label_i, tok_i);
+    // 条件をループの末尾で判定して、1周あたりのジャンプを1回にする。
+    // goto l_continue
+    cmd_add_goto(ctx, continue_label_i, tok_i);
 
-    // do body; pop; continue
+    // l_body: do body; pop
+    cmd_add_label(ctx, body_label_i, tok_i);
     gen_exp(ctx, body_exp_i);
     cmd_add(ctx, cmd_pop, tok_i);
 
-    cmd_add_goto(ctx, continue_label_i, tok_i);
+    // l_continue: if cond is true, goto l_body
+    cmd_add_label(ctx, continue_label_i, tok_i);
+    gen_jump_cond(ctx, cond_exp_i, true, body_label_i);
 
     // l_break: push null
     cmd_add_label(ctx, break_label_i, tok_i);
@@ -1644,7 +2460,7 @@ static void gen_return(Ctx *ctx, int exp_i) {
     assert(exp->kind == exp_return);
 
     gen_exp(ctx, exp->exp_l);
-    cmd_add(ctx, cmd_return, exp->tok_i);
+    cmd_add_return(ctx, exp->tok_i);
 }
 
 static void gen_lval(Ctx *ctx, int exp_i) {
@@ -1721,6 +2537,138 @@ static void gen_exp(Ctx *ctx, int exp_i) {
     }
 }
 
+// -----------------------------------------------
+// 覗き穴最適化
+// -----------------------------------------------
+
+// 生成された命令列の末尾に近い数個の命令 (窓) を見て、より少ない命令に書き換える。
+// ラベルも命令として並んでいるので、ジャンプ先をまたぐ窓は書き換えの対象にならない。
+
+static bool peephole_is_op(const Cmd *cmd, OpKind op) {
+    return cmd->kind == cmd_op && cmd->x == (int)op;
+}
+
+static bool peephole_is_cmp(const Cmd *cmd) {
+    return cmd->kind == cmd_op && op_is_cmp(cmd->x);
+}
+
+// r op l を表す比較
+static OpKind peephole_cmp_swap(OpKind op) {
+    switch (op) {
+    case op_eq:
+    case op_ne:
+        return op;
+    case op_lt:
+        return op_gt;
+    case op_le:
+        return op_ge;
+    case op_gt:
+        return op_lt;
+    case op_ge:
+        return op_le;
+    default:
+        failwith("Not a comparison");
+    }
+}
+
+// 副作用なしに値を1つ積む命令か。
+static bool peephole_is_pure_push(const Cmd *cmd) {
+    return cmd->kind == cmd_push_int || cmd->kind == cmd_push_str ||
+           cmd->kind == cmd_push_extern || cmd->kind == cmd_load_local ||
+           cmd->kind == cmd_load_global || cmd->kind == cmd_dup;
+}
+
+// 命令列 cmds[0..*len) の末尾に規則を1回適用する。適用したら true を返す。
+static bool peephole_step(int rules, Cmd *cmds, int *len) {
+    int n = *len;
+    Cmd *a = n >= 3 ? &cmds[n - 3] : NULL;
+    Cmd *b = n >= 2 ? &cmds[n - 2] : NULL;
+    Cmd *c = n >= 1 ? &cmds[n - 1] : NULL;
+
+    if (rules & peephole_cmp) {
+        // cmp; push_int 0; op_eq ---> !cmp
+        if (a != NULL && peephole_is_cmp(a) && b->kind == cmd_push_int &&
+            b->x == 0 && peephole_is_op(c, op_eq)) {
+            a->x = op_cmp_negate(a->x);
+            *len = n - 2;
+            return true;
+        }
+
+        // swap; cmp ---> 左右を入れ替えた cmp
+        if (b != NULL && b->kind == cmd_swap && peephole_is_cmp(c)) {
+            *b = *c;
+            b->x = peephole_cmp_swap(c->x);
+            *len = n - 1;
+            return true;
+        }
+    }
+
+    if ((rules & peephole_set_pop) && b != NULL && c->kind == cmd_pop) {
+        if (b->kind == cmd_store_local) {
+            b->kind = cmd_store_local_pop;
+            *len = n - 1;
+            return true;
+        }
+        if (b->kind == cmd_store_global) {
+            b->kind = cmd_store_global_pop;
+            *len = n - 1;
+            return true;
+        }
+        if (b->kind == cmd_cell_set) {
+            b->kind = cmd_cell_set_pop;
+            *len = n - 1;
+            return true;
+        }
+        if (b->kind == cmd_index_set) {
+            b->kind = cmd_index_set_pop;
+            *len = n - 1;
+            return true;
+        }
+    }
+
+    if ((rules & peephole_push_pop) && b != NULL && c->kind == cmd_pop &&
+        peephole_is_pure_push(b)) {
+        *len = n - 2;
+        return true;
+    }
+
+    return false;
+}
+
+// 命令列に覗き穴最適化を適用する。ラベルの解決より前に行う。
+static void gen_peephole(Ctx *ctx) {
+    int rules = ctx->peephole_rules;
+    Cmd *cmds = ctx->cmds.data;
+    int old_len = ctx->cmds.len;
+    int len = 0;
+
+    for (int cmd_i = 0; cmd_i < old_len; cmd_i++) {
+        Cmd cmd = cmds[cmd_i];
+
+        // jump L; label L ---> label L
+        if ((rules & peephole_jump_next) && cmd.kind == cmd_label && len >= 1 &&
+            cmds[len - 1].kind == cmd_jump && cmds[len - 1].x == cmd.x) {
+            len--;
+        }
+
+        // 命令の位置を参照している番号を更新する。
+        // これらの命令は窓の途中に現れないので、以降の書き換えで移動しない。
+        if (cmd_i == ctx->cmd_i_entry) {
+            ctx->cmd_i_entry = len;
+        }
+        if (cmd_i == ctx->cmd_i_exit) {
+            ctx->cmd_i_exit = len;
+        }
+
+        cmds[len++] = cmd;
+        while (peephole_step(rules, cmds, &len)) {
+        }
+    }
+
+    ctx->cmds.len = len;
+    ctx->peephole_removed = old_len - len;
+}
+
 static void gen_resolve_labels(Ctx *ctx) {
     // ラベルが指すコマンド番号を計算する。
     for (int i = 0; i < ctx->cmds.len; i++) {
@@ -1746,6 +2694,53 @@ static void gen_resolve_labels(Ctx *ctx) {
     }
 }
 
+static bool cmd_kind_is_jump(CmdKind kind) {
+    return kind == cmd_jump || kind == cmd_jump_unless || kind == cmd_jump_if ||
+           (cmd_jump_if_eq <= kind && kind <= cmd_jump_if_ge);
+}
+
+// 命令リストからラベルを取り除き、ジャンプ先をラベル番号から命令番号に書き換える。
+// 実行時にラベルを経由せずに済むようにする。
+static void gen_link(Ctx *ctx) {
+    // 各命令の移動先を計算する。ラベルはその直後の命令と同じ位置に移る。
+    int *map = mem_alloc(ctx->cmds.len + 1, sizeof(int));
+    int len = 0;
+    for (int cmd_i = 0; cmd_i < ctx->cmds.len; cmd_i++) {
+        map[cmd_i] = len;
+        if (ctx->cmds.data[cmd_i].kind != cmd_label) {
+            len++;
+        }
+    }
+    map[ctx->cmds.len] = len;
+
+    for (int label_i = 0; label_i < ctx->labels.len; label_i++) {
+        Label *label = label_get(ctx, label_i);
+        label->cmd_i = map[label->cmd_i];
+    }
+
+    for (int cmd_i = 0; cmd_i < ctx->cmds.len; cmd_i++) {
+        Cmd *cmd = &ctx->cmds.data[cmd_i];
+        if (cmd->kind == cmd_label) {
+            continue;
+        }
+
+        if (cmd_kind_is_jump(cmd->kind)) {
+            cmd->x = label_get(ctx, cmd->x)->cmd_i;
+        }
+        ctx->cmds.data[map[cmd_i]] = *cmd;
+    }
+    ctx->cmds.len = len;
+
+    for (int fun_i = 0; fun_i < ctx->funs.len; fun_i++) {
+        Fun *fun = fun_get(ctx, fun_i);
+        fun->cmd_i = map[fun->cmd_i];
+    }
+    ctx->cmd_i_entry = map[ctx->cmd_i_entry];
+    ctx->cmd_i_exit = map[ctx->cmd_i_exit];
+
+    free(map);
+}
+
 static void gen(Ctx *ctx) {
     ctx->scope_i_global = scope_add_global(ctx, ctx->tok_i_eof);
     ctx->scope_i_current = ctx->scope_i_global;
@@ -1761,7 +2756,9 @@ static void gen(Ctx *ctx) {
 
     ctx->fun_i_main = fun_add_closure(ctx, ctx->scope_i_global, main_label_i);
 
+    gen_peephole(ctx);
     gen_resolve_labels(ctx);
+    gen_link(ctx);
 }
 
 // ###############################################
@@ -1776,19 +2773,27 @@ static int eval_current_tok_i(Ctx *ctx);
 // 参照セルリスト
 // -----------------------------------------------
 
+// 参照セルリストを空にする。2回目以降の評価では、前回の領域をそのまま再利用する。
 static void cell_initialize(Ctx *ctx) {
-    mem_reserve((void **)&ctx->cells.data, 0, sizeof(Cell),
-                &ctx->cells.capacity, cell_len_min);
-    ctx->cells.len = ctx->cells.capacity;
+    if (ctx->cells.data == NULL) {
+        mem_reserve((void **)&ctx->cells.data, 0, sizeof(Cell),
+                    &ctx->cells.capacity, cell_len_min);
+        ctx->cells.len = ctx->cells.capacity;
+    }
 
     ctx->stack_end = 0;
     ctx->heap_end = stack_len_min;
-    ctx->gc_threshold = heap_len_min / 2;
-}
+    ctx->gc_threshold = (ctx->cells.len - stack_len_min) / 2;
+    ctx->gc_malloc_bytes = 0;
+    ctx->gc_malloc_threshold = gc_malloc_threshold_min;
 
-static Cell *cell_get(Ctx *ctx, int cell_i) {
-    assert(0 <= cell_i && cell_i < ctx->cells.len);
-    return &ctx->cells.data[cell_i];
+    ctx->heap_len_max = heap_len_max_default;
+    if (ctx->externals != NULL && ctx->externals->heap_len_max > 0) {
+        ctx->heap_len_max = ctx->externals->heap_len_max;
+    }
+    if (ctx->heap_len_max < heap_len_min) {
+        ctx->heap_len_max = heap_len_min;
+    }
 }
 
 // -----------------------------------------------
@@ -1820,9 +2825,36 @@ typedef struct CellIndexPair {
     int cell_l, cell_r;
 } CellIndexPair;
 
+// ヒープ領域を拡張して、少なくとも min_heap_len 個の参照セルを格納できるようにする。
+// 長さは2倍ずつ増やし、上限を超えるなら拡張しない。
+// 参照セルは番号で指定されるので、拡張した後もそのまま使える。
+static bool heap_grow(Ctx *ctx, int min_heap_len) {
+    int heap_len = ctx->cells.len - stack_len_min;
+    if (min_heap_len <= heap_len) {
+        return true;
+    }
+    if (min_heap_len > ctx->heap_len_max) {
+        return false;
+    }
+
+    int new_heap_len = heap_len;
+    while (new_heap_len < min_heap_len) {
+        new_heap_len = new_heap_len <= ctx->heap_len_max / 2
+                           ? new_heap_len * 2
+                           : ctx->heap_len_max;
+    }
+
+    mem_resize((void **)&ctx->cells.data, sizeof(Cell), &ctx->cells.capacity,
+               stack_len_min + new_heap_len);
+    ctx->cells.len = ctx->cells.capacity;
+    ctx->gc_threshold = new_heap_len / 2;
+    return true;
+}
+
 static CellIndexPair heap_alloc(Ctx *ctx, int count) {
-    if (ctx->heap_end + count >= ctx->cells.len) {
-        // FIXME: ヒープを自動で拡張する。
+    int min_heap_len = ctx->heap_end + count - stack_len_min;
+    if (ctx->heap_end + count >= ctx->cells.len &&
+        !heap_grow(ctx, min_heap_len + 1)) {
         eval_abort(ctx, "OUT OF MEMORY", eval_current_tok_i(ctx));
         return (CellIndexPair){
             .cell_l = stack_len_min,
@@ -1834,6 +2866,9 @@ static CellIndexPair heap_alloc(Ctx *ctx, int count) {
     int cell_r = ctx->heap_end + count;
     ctx->heap_end += count;
 
+    // GC や以前の評価で使われていた参照セルかもしれないので、空にしておく。
+    memset(ctx->cells.data + cell_l, 0, count * sizeof(Cell));
+
     if (ctx->cells.len - ctx->heap_end <= ctx->gc_threshold) {
         ctx->does_gc = true;
     }
@@ -1843,11 +2878,23 @@ static CellIndexPair heap_alloc(Ctx *ctx, int count) {
     };
 }
 
+// 参照セルの外に、GC が管理する領域を bytes バイト確保したことを記録する。
+// 文字列のバッファなどは参照セルを使わないので、別に数えて GC を予約する。
+static void heap_count_malloc(Ctx *ctx, size_t bytes) {
+    ctx->gc_malloc_bytes += bytes;
+    if (ctx->gc_malloc_bytes >= ctx->gc_malloc_threshold) {
+        ctx->does_gc = true;
+    }
+}
+
 // -----------------------------------------------
 // フレームスタック
 // -----------------------------------------------
 
-static void frame_push(Ctx *ctx, int cmd_i, int env_i, int tok_i) {
+static int closure_upvals(Ctx *ctx, int closure_i);
+
+static void frame_push(Ctx *ctx, int cmd_i, int env_i, int base, int closure_i,
+                       int tok_i) {
     vec_grow((void **)&ctx->frames.data, ctx->frames.len, &ctx->frames.capacity,
              sizeof(Frame), 1);
 
@@ -1855,6 +2902,9 @@ static void frame_push(Ctx *ctx, int cmd_i, int env_i, int tok_i) {
     ctx->frames.data[frame_i] = (Frame){
         .cmd_i = cmd_i,
         .env_i = env_i,
+        .base = base,
+        .closure_i = closure_i,
+        .upvals = closure_upvals(ctx, closure_i),
         .tok_i = tok_i,
     };
 }
@@ -1874,33 +2924,107 @@ static Frame *frame_current(Ctx *ctx) {
 // 文字列リスト
 // -----------------------------------------------
 
-static int str_add(Ctx *ctx, const char *str) {
+// 長さ len の文字列を、キャパシティ capacity の新しい領域に複製して追加する。
+static int str_add_len(Ctx *ctx, const char *data, int len, int capacity) {
+    assert(0 <= len && len <= capacity);
+
     vec_grow((void **)&ctx->strs.data, ctx->strs.len, &ctx->strs.capacity,
              sizeof(Str), 1);
 
+    // mem_alloc は確保に失敗したら中断するので、buf は NULL にならない。
+    char *buf = mem_alloc(capacity + 1, sizeof(char));
+    memcpy(buf, data, len);
+    buf[len] = '\0';
+    heap_count_malloc(ctx, capacity + 1);
+
     int str_i = ctx->strs.len++;
-    int size = strlen(str);
     ctx->strs.data[str_i] = (Str){
-        .data = string_slice(str, 0, size),
-        .len = size,
-        .capacity = size,
+        .data = buf,
+        .len = len,
+        .capacity = capacity,
+        .owner = -1,
     };
 
     return str_i;
 }
 
+static int str_add(Ctx *ctx, const char *str) {
+    int len = strlen(str);
+    return str_add_len(ctx, str, len, len);
+}
+
 static Str *str_get(Ctx *ctx, int str_i) {
     assert(0 <= str_i && str_i < ctx->strs.len);
     return &ctx->strs.data[str_i];
 }
 
+// 定数から文字列を生成する。定数番号と同じ番号の文字列になる。
+// 文字列リテラルはこれらを共有するので、評価のたびに文字列を生成しなくてよい。
+// 2回目以降の評価では、定数以外の文字列を破棄して、定数の文字列を再利用する。
+static void str_add_consts(Ctx *ctx) {
+    if (ctx->str_len_const > 0 || ctx->consts.len == 0) {
+        for (int i = ctx->str_len_const; i < ctx->strs.len; i++) {
+            free(ctx->strs.data[i].data);
+        }
+        ctx->strs.len = ctx->str_len_const;
+        return;
+    }
+
+    assert(ctx->strs.len == 0);
+
+    for (int const_i = 0; const_i < ctx->consts.len; const_i++) {
+        int str_i = str_add(ctx, data_get(ctx, const_i));
+        assert(str_i == const_i);
+    }
+    ctx->str_len_const = ctx->consts.len;
+}
+
+// 文字列の末尾に追記する。領域が足りなければ、キャパシティを2倍ずつ増やす。
+static void str_append(Ctx *ctx, int str_i, const char *data, int len) {
+    Str *str = str_get(ctx, str_i);
+
+    int new_len = str->len + len;
+    if (new_len > str->capacity) {
+        int new_capacity = str->capacity * 2;
+        if (new_capacity < new_len) {
+            new_capacity = new_len;
+        }
+
+        char *buf = realloc(str->data, new_capacity + 1);
+        if (buf == NULL) {
+            failwith("FATAL ERROR str_append");
+        }
+        heap_count_malloc(ctx, new_capacity - str->capacity);
+        str->data = buf;
+        str->capacity = new_capacity;
+    }
+
+    memmove(str->data + str->len, data, len);
+    str->len = new_len;
+    str->data[new_len] = '\0';
+}
+
+// 2つの文字列を連結した新しい文字列を生成する。
+static int str_concat(Ctx *ctx, int l_str_i, int r_str_i) {
+    // 文字列の領域は文字列リストとは別に確保されているので、
+    // 文字列リストが拡張されても data は無効にならない。
+    const Str *l = str_get(ctx, l_str_i);
+    const Str *r = str_get(ctx, r_str_i);
+    const char *r_data = r->data;
+    int r_len = r->len;
+
+    int str_i = str_add_len(ctx, l->data, l->len, l->len + r_len);
+    str_append(ctx, str_i, r_data, r_len);
+    return str_i;
+}
+
 static int str_slice_fun(Ctx *ctx, int str_i, int l, int r) {
     Str *str = str_get(ctx, str_i);
 
     l = l < 0 ? 0 : l;
     r = r > str->len ? str->len : r;
-    char *data = string_slice(str->data, l, r);
-    return str_add(ctx, data);
+    r = r < l ? l : r;
+    return str_add_len(ctx, str->data + l, r - l, r - l);
 }
 
 // -----------------------------------------------
@@ -1930,49 +3054,155 @@ static Array *array_get(Ctx *ctx, int array_i) {
     return &ctx->arrays.data[array_i];
 }
 
-static void array_reserve(Ctx *ctx, int array_i, int new_len) {
-    Array *array = array_get(ctx, array_i);
-    if (new_len <= array->cell_r - array->cell_l) {
-        return;
+// すべての配列を破棄する。
+static void array_free_all(Ctx *ctx) {
+    for (int i = 0; i < ctx->arrays.len; i++) {
+        free(ctx->arrays.data[i].ints);
     }
+    ctx->arrays.len = 0;
+}
 
-    assert(array->len <= new_len);
-
-    int new_capacity = array->len + new_len;
-    CellIndexPair new_range = heap_alloc(ctx, new_capacity);
+// 整数を詰めて格納する、空の配列を生成する。
+static int array_add_packed(Ctx *ctx, int capacity) {
+    int array_i = array_add(ctx, 0, 0);
 
-    memcpy(ctx->cells.data + new_range.cell_l, ctx->cells.data + array->cell_l,
-           (new_range.cell_r - new_range.cell_l) * sizeof(Cell));
+    Array *array = array_get(ctx, array_i);
+    array->packed = true;
+    mem_resize((void **)&array->ints, sizeof(int), &array->ints_capacity,
+               capacity);
+    heap_count_malloc(ctx, (size_t)array->ints_capacity * sizeof(int));
+    return array_i;
 }
 
-// 配列の index 番目の要素の参照セル番号を取得する。
-static int array_ref(Ctx *ctx, int array_i, int index) {
+// 詰めた配列を、参照セルに格納する配列に変える。
+static void array_unpack(Ctx *ctx, int array_i) {
     Array *array = array_get(ctx, array_i);
-
-    if (!(0 <= index && index < array->len)) {
-        eval_abort(ctx, "配列の要素番号が無効です。", eval_current_tok_i(ctx));
-        return array->cell_l;
+    if (!array->packed) {
+        return;
     }
 
-    return array->cell_l + index;
-}
+    CellIndexPair range = heap_alloc(ctx, array->ints_capacity);
+    if (ctx->aborted) {
+        return;
+    }
 
-static Cell array_get_item(Ctx *ctx, int array_i, int index) {
-    int cell_i = array_ref(ctx, array_i, index);
-    return ctx->cells.data[cell_i];
-}
+    Cell *cells = ctx->cells.data + range.cell_l;
+    for (int i = 0; i < array->len; i++) {
+        cells[i] = (Cell){.ty = ty_int, .val = array->ints[i]};
+    }
 
-static void array_set_item(Ctx *ctx, int array_i, int index, Cell item) {
-    int cell_i = array_ref(ctx, array_i, index);
-    ctx->cells.data[cell_i] = item;
+    free(array->ints);
+    array->packed = false;
+    array->ints = NULL;
+    array->ints_capacity = 0;
+    array->cell_l = range.cell_l;
+    array->cell_r = range.cell_r;
 }
 
-static void array_push(Ctx *ctx, int array_i, Cell item) {
+// 配列の容量を new_len 以上に広げる。
+// 要素の追加が償却 O(1) になるように、容量は2倍ずつ増やす。
+// 移動した配列の古い領域は、GC の圧縮によって回収される。
+static void array_reserve(Ctx *ctx, int array_i, int new_len) {
     Array *array = array_get(ctx, array_i);
-    int index = array->len;
-    array_reserve(ctx, array_i, index + 1);
+    int capacity =
+        array->packed ? array->ints_capacity : array->cell_r - array->cell_l;
+    if (new_len <= capacity) {
+        return;
+    }
 
-    array->len++;
+    assert(array->len <= new_len);
+
+    int new_capacity = capacity * 2;
+    if (new_capacity < array_capacity_min) {
+        new_capacity = array_capacity_min;
+    }
+    if (new_capacity < new_len) {
+        new_capacity = new_len;
+    }
+
+    if (array->packed) {
+        mem_resize((void **)&array->ints, sizeof(int), &array->ints_capacity,
+                   new_capacity);
+        heap_count_malloc(ctx, (size_t)(new_capacity - capacity) * sizeof(int));
+        return;
+    }
+
+    // 配列がヒープ領域の末尾にあるなら、続きの領域を確保して、その場で広げる。
+    if (capacity > 0 && array->cell_r == ctx->heap_end) {
+        CellIndexPair extra_range = heap_alloc(ctx, new_capacity - capacity);
+        if (ctx->aborted) {
+            return;
+        }
+
+        assert(extra_range.cell_l == array->cell_r);
+        array->cell_r = extra_range.cell_r;
+        return;
+    }
+
+    CellIndexPair new_range = heap_alloc(ctx, new_capacity);
+    if (ctx->aborted) {
+        return;
+    }
+
+    memcpy(ctx->cells.data + new_range.cell_l, ctx->cells.data + array->cell_l,
+           array->len * sizeof(Cell));
+
+    // GC が配列の要素を追跡できるように、移動先の範囲を記録する。
+    array->cell_l = new_range.cell_l;
+    array->cell_r = new_range.cell_r;
+}
+
+static bool array_index_is_valid(Ctx *ctx, int array_i, int index) {
+    if (!(0 <= index && index < array_get(ctx, array_i)->len)) {
+        eval_abort(ctx, "配列の要素番号が無効です。", eval_current_tok_i(ctx));
+        return false;
+    }
+    return true;
+}
+
+// 配列の index 番目の要素の参照セル番号を取得する。
+// 詰めた配列の要素は参照セルを持たないので、配列を展開する。
+static int array_ref(Ctx *ctx, int array_i, int index) {
+    if (!array_index_is_valid(ctx, array_i, index)) {
+        return array_get(ctx, array_i)->cell_l;
+    }
+
+    array_unpack(ctx, array_i);
+    return array_get(ctx, array_i)->cell_l + index;
+}
+
+static Cell array_get_item(Ctx *ctx, int array_i, int index) {
+    const Array *array = array_get(ctx, array_i);
+    if (array->packed) {
+        if (!array_index_is_valid(ctx, array_i, index)) {
+            return s_cell_null;
+        }
+        return (Cell){.ty = ty_int, .val = array->ints[index]};
+    }
+
+    int cell_i = array_ref(ctx, array_i, index);
+    return ctx->cells.data[cell_i];
+}
+
+static void array_set_item(Ctx *ctx, int array_i, int index, Cell item) {
+    Array *array = array_get(ctx, array_i);
+    if (array->packed && item.ty == ty_int) {
+        if (array_index_is_valid(ctx, array_i, index)) {
+            array->ints[index] = item.val;
+        }
+        return;
+    }
+
+    int cell_i = array_ref(ctx, array_i, index);
+    ctx->cells.data[cell_i] = item;
+}
+
+static void array_push(Ctx *ctx, int array_i, Cell item) {
+    Array *array = array_get(ctx, array_i);
+    int index = array->len;
+    array_reserve(ctx, array_i, index + 1);
+
+    array->len++;
     array_set_item(ctx, array_i, index, item);
 }
 
@@ -1988,7 +3218,7 @@ static void array_pop(Ctx *ctx, int array_i) {
 // 環境リスト
 // -----------------------------------------------
 
-static int env_add(Ctx *ctx, int parent_env_i, int fun_i) {
+static int env_add(Ctx *ctx, int fun_i) {
     vec_grow((void **)&ctx->envs.data, ctx->envs.len, &ctx->envs.capacity,
              sizeof(Env), 1);
 
@@ -1998,7 +3228,6 @@ static int env_add(Ctx *ctx, int parent_env_i, int fun_i) {
 
     int env_i = ctx->envs.len++;
     ctx->envs.data[env_i] = (Env){
-        .parent = parent_env_i,
         .scope_i = fun->scope_i,
         .array_i = array_i,
     };
@@ -2010,18 +3239,60 @@ static Env *env_get(Ctx *ctx, int env_i) {
     return &ctx->envs.data[env_i];
 }
 
+// 末尾呼び出しのために、呼び出し元の環境を呼び出し先の関数の環境として作り直す。
+// 環境が捕獲されているか、ローカル変数が収まらないなら、-1 を返す。
+static int env_reuse(Ctx *ctx, int env_i, int fun_i) {
+    Env *env = env_get(ctx, env_i);
+    Fun *fun = fun_get(ctx, fun_i);
+    Scope *scope = scope_get(ctx, fun->scope_i);
+    Array *array = array_get(ctx, env->array_i);
+
+    if (env->captured || array->cell_r - array->cell_l < scope->len) {
+        return -1;
+    }
+
+    memset(ctx->cells.data + array->cell_l, 0, scope->len * sizeof(Cell));
+    array->len = scope->len;
+
+    *env = (Env){
+        .scope_i = fun->scope_i,
+        .array_i = env->array_i,
+    };
+    return env_i;
+}
+
+// 実行中の関数から見た、index 番目の変数の参照セル番号を取得する。
+// var_kind: 変数の置き場所 (VarKind)
+// 変数の位置はコード生成時に検査済みなので、ここでは検査しない。
+static int frame_var_cell_i(Ctx *ctx, int var_kind, int index) {
+    const Frame *frame = frame_current(ctx);
+    if (var_kind == var_global) {
+        return stack_len_min + index;
+    }
+    if (var_kind == var_upval) {
+        return ctx->cells.data[frame->upvals + index].val;
+    }
+    if (frame->base >= 0) {
+        return frame->base + index;
+    }
+
+    const Array *array = &ctx->arrays.data[ctx->envs.data[frame->env_i].array_i];
+    assert(0 <= index && index < array->len);
+    return array->cell_l + index;
+}
+
 // -----------------------------------------------
 // クロージャリスト
 // -----------------------------------------------
 
-static int closure_add(Ctx *ctx, int fun_i, int env_i) {
+static int closure_add(Ctx *ctx, int fun_i, int upval_array_i) {
     vec_grow((void **)&ctx->closures.data, ctx->closures.len,
              &ctx->closures.capacity, sizeof(Closure), 1);
 
     int closure_i = ctx->closures.len++;
     ctx->closures.data[closure_i] = (Closure){
         .fun_i = fun_i,
-        .env_i = env_i,
+        .upval_array_i = upval_array_i,
     };
     return closure_i;
 }
@@ -2031,41 +3302,326 @@ static Closure *closure_get(Ctx *ctx, int closure_i) {
     return &ctx->closures.data[closure_i];
 }
 
+// クロージャの捕獲変数の参照セルが並ぶ領域の先頭のセル番号 (トップレベルなら -1)
+static int closure_upvals(Ctx *ctx, int closure_i) {
+    if (closure_i < 0) {
+        return -1;
+    }
+    return array_get(ctx, closure_get(ctx, closure_i)->upval_array_i)->cell_l;
+}
+
 // -----------------------------------------------
-// 外部関数フレーム
+// ガベージコレクション
 // -----------------------------------------------
 
-static void extern_frame_activate(Ctx *ctx, int arg_array_i,
-                                  int result_cell_i) {
-    assert(!ctx->extern_calling);
+// 不要になった参照セルや配列などを破棄して、ヒープ領域を前に詰める。
+// GC はマーク、ムーブ、リライトの3段階で行う。
+// - マーク: ルートから辿れる要素に印をつける。ルートはスタック領域の参照セル、
+//   グローバル変数の環境、各フレームの環境とクロージャ。
+// - ムーブ: 印のついた要素を順序を保って前に詰め、移動先をマップに記録する。
+//   スタック領域と定数の文字列は動かさない。
+// - リライト: 参照セルなどに含まれる要素番号をマップで書き換える。
+// ヒープの残りが gc_threshold 以下になるか、参照セルの外に確保したバッファが
+// gc_malloc_threshold を超えると does_gc が立つ。
+// 命令の実行中に行うと壊れるため、命令と命令の間でのみ実行する。
+
+// マップは GC のたびに使い回す。要素数が増えたときだけ領域を拡張する。
+static void gc_map_reset(GcMap *map, int len) {
+    mem_resize((void **)&map->data, sizeof(int), &map->capacity, len);
+    map->len = len;
+    if (len > 0) {
+        memset(map->data, 0, len * sizeof(int));
+    }
+}
 
-    ctx->extern_calling = true;
-    ctx->extern_frame = (ExternFrame){
-        .err = false,
-        .arg_array_i = arg_array_i,
-        .result_cell_i = result_cell_i,
-    };
+static void gc_begin(Ctx *ctx) {
+    gc_map_reset(&ctx->gc_cell_map, ctx->heap_end);
+    gc_map_reset(&ctx->gc_str_map, ctx->strs.len);
+    gc_map_reset(&ctx->gc_array_map, ctx->arrays.len);
+    gc_map_reset(&ctx->gc_env_map, ctx->envs.len);
+    gc_map_reset(&ctx->gc_closure_map, ctx->closures.len);
+    ctx->gc_stack.len = 0;
+}
+
+static GcMap *gc_map_of(Ctx *ctx, int ty) {
+    switch (ty) {
+    case ty_str:
+        return &ctx->gc_str_map;
+    case ty_array:
+        return &ctx->gc_array_map;
+    case ty_closure:
+        return &ctx->gc_closure_map;
+    case ty_env:
+        return &ctx->gc_env_map;
+    case ty_cell:
+        return &ctx->gc_cell_map;
+    default:
+        return NULL;
+    }
 }
 
-static void extern_frame_deactivate(Ctx *ctx) {
-    ctx->extern_calling = false;
-    ctx->extern_frame = (ExternFrame){};
+// 値が指すオブジェクトをマークして、GC スタックに積む。
+static void gc_mark(Ctx *ctx, Cell cell) {
+    GcMap *map = gc_map_of(ctx, cell.ty);
+    if (map == NULL) {
+        return;
+    }
+
+    assert(0 <= cell.val && cell.val < map->len);
+    if (map->data[cell.val]) {
+        return;
+    }
+    map->data[cell.val] = 1;
+
+    vec_grow((void **)&ctx->gc_stack.data, ctx->gc_stack.len,
+             &ctx->gc_stack.capacity, sizeof(Cell), 1);
+    ctx->gc_stack.data[ctx->gc_stack.len++] = cell;
+}
+
+static void gc_mark_array(Ctx *ctx, int array_i) {
+    Array *array = array_get(ctx, array_i);
+    GcMap *map = &ctx->gc_cell_map;
+
+    // 詰めた配列は参照セルを持たない。
+    if (array->packed) {
+        return;
+    }
+
+    // 使われていない領域も配列の一部として残す。
+    // 古い値は参照先が破棄されているかもしれないので、消しておく。
+    for (int i = array->cell_l + array->len; i < array->cell_r; i++) {
+        if (!map->data[i]) {
+            map->data[i] = 1;
+            ctx->cells.data[i] = s_cell_null;
+        }
+    }
+
+    for (int i = array->cell_l; i < array->cell_l + array->len; i++) {
+        gc_mark(ctx, (Cell){.ty = ty_cell, .val = i});
+    }
+}
+
+// GC スタックが空になるまで、参照先をマークする処理を繰り返す。
+static void gc_mark_loop(Ctx *ctx) {
+    while (ctx->gc_stack.len > 0) {
+        Cell cell = ctx->gc_stack.data[--ctx->gc_stack.len];
+
+        switch (cell.ty) {
+        case ty_cell:
+            gc_mark(ctx, ctx->cells.data[cell.val]);
+            break;
+        case ty_array:
+            gc_mark_array(ctx, cell.val);
+            break;
+        case ty_env: {
+            Env *env = env_get(ctx, cell.val);
+            gc_mark(ctx, (Cell){.ty = ty_array, .val = env->array_i});
+            break;
+        }
+        case ty_closure: {
+            Closure *closure = closure_get(ctx, cell.val);
+            gc_mark(ctx, (Cell){.ty = ty_array, .val = closure->upval_array_i});
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+// スタック上の値と、呼び出し中のフレームの環境とクロージャをマークする。
+static void gc_mark_roots(Ctx *ctx) {
+    for (int i = 0; i < ctx->stack_end; i++) {
+        gc_mark(ctx, ctx->cells.data[i]);
+    }
+
+    gc_mark(ctx, (Cell){.ty = ty_env, .val = ctx->env_i_global});
+
+    for (int i = 0; i < ctx->frames.len; i++) {
+        const Frame *frame = &ctx->frames.data[i];
+        if (frame->env_i >= 0) {
+            gc_mark(ctx, (Cell){.ty = ty_env, .val = frame->env_i});
+        }
+        if (frame->closure_i >= 0) {
+            gc_mark(ctx, (Cell){.ty = ty_closure, .val = frame->closure_i});
+        }
+    }
+}
+
+// マーク済みの要素を前に詰めて、マップを移動先の要素番号に書き換える。
+// start より前の要素は移動しない。詰めた後の要素数を返す。
+static int gc_move(GcMap *map, void *data, int unit, int start) {
+    char *p = (char *)data;
+    int len = start;
+
+    for (int i = 0; i < start && i < map->len; i++) {
+        map->data[i] = i;
+    }
+
+    for (int i = start; i < map->len; i++) {
+        if (!map->data[i]) {
+            map->data[i] = -1;
+            continue;
+        }
+
+        map->data[i] = len;
+        if (len != i) {
+            memcpy(p + len * unit, p + i * unit, unit);
+        }
+        len++;
+    }
+    return len;
+}
+
+static void gc_move_all(Ctx *ctx) {
+    // 破棄される文字列のバッファを解放する。定数の文字列は残す。
+    for (int i = ctx->str_len_const; i < ctx->strs.len; i++) {
+        if (!ctx->gc_str_map.data[i]) {
+            free(ctx->strs.data[i].data);
+        }
+    }
+
+    // 破棄される配列の詰めた領域を解放する。
+    for (int i = 0; i < ctx->arrays.len; i++) {
+        if (!ctx->gc_array_map.data[i]) {
+            free(ctx->arrays.data[i].ints);
+        }
+    }
+
+    // スタック領域は移動しない。
+    ctx->heap_end = gc_move(&ctx->gc_cell_map, ctx->cells.data, sizeof(Cell),
+                            stack_len_min);
+    ctx->strs.len = gc_move(&ctx->gc_str_map, ctx->strs.data, sizeof(Str),
+                            ctx->str_len_const);
+    ctx->arrays.len =
+        gc_move(&ctx->gc_array_map, ctx->arrays.data, sizeof(Array), 0);
+    ctx->envs.len = gc_move(&ctx->gc_env_map, ctx->envs.data, sizeof(Env), 0);
+    ctx->closures.len =
+        gc_move(&ctx->gc_closure_map, ctx->closures.data, sizeof(Closure), 0);
+}
+
+// 移動前の要素番号を移動後のものに置き換える。
+static int gc_rewrite_index(GcMap *map, int i) {
+    assert(0 <= i && i < map->len && map->data[i] >= 0);
+    return map->data[i];
+}
+
+static void gc_rewrite_cell(Ctx *ctx, Cell *cell) {
+    GcMap *map = gc_map_of(ctx, cell->ty);
+    if (map == NULL) {
+        return;
+    }
+    cell->val = gc_rewrite_index(map, cell->val);
 }
 
-static void extern_frame_resolve(Ctx *ctx, Cell result) {
-    assert(ctx->extern_calling);
-    *cell_get(ctx, ctx->extern_frame.result_cell_i) = result;
+static void gc_rewrite_all(Ctx *ctx) {
+    for (int i = 0; i < ctx->stack_end; i++) {
+        gc_rewrite_cell(ctx, &ctx->cells.data[i]);
+    }
+    for (int i = stack_len_min; i < ctx->heap_end; i++) {
+        gc_rewrite_cell(ctx, &ctx->cells.data[i]);
+    }
+
+    for (int i = 0; i < ctx->arrays.len; i++) {
+        Array *array = &ctx->arrays.data[i];
+        int capacity = array->cell_r - array->cell_l;
+
+        // 空の領域は他の配列の領域と重なりうるので、移動先を持たない。
+        if (capacity == 0) {
+            array->cell_l = stack_len_min;
+            array->cell_r = stack_len_min;
+            continue;
+        }
+
+        array->cell_l = gc_rewrite_index(&ctx->gc_cell_map, array->cell_l);
+        array->cell_r = array->cell_l + capacity;
+    }
+
+    for (int i = 0; i < ctx->envs.len; i++) {
+        Env *env = &ctx->envs.data[i];
+        env->array_i = gc_rewrite_index(&ctx->gc_array_map, env->array_i);
+    }
+    ctx->env_i_global = gc_rewrite_index(&ctx->gc_env_map, ctx->env_i_global);
+
+    for (int i = 0; i < ctx->closures.len; i++) {
+        Closure *closure = &ctx->closures.data[i];
+        closure->upval_array_i =
+            gc_rewrite_index(&ctx->gc_array_map, closure->upval_array_i);
+    }
+
+    // 所有者のセルが破棄されたなら、所有者はいなくなる。
+    for (int i = 0; i < ctx->strs.len; i++) {
+        Str *str = &ctx->strs.data[i];
+        if (str->owner >= 0) {
+            str->owner = ctx->gc_cell_map.data[str->owner];
+        }
+    }
+
+    for (int i = 0; i < ctx->frames.len; i++) {
+        Frame *frame = &ctx->frames.data[i];
+        if (frame->env_i >= 0) {
+            frame->env_i = gc_rewrite_index(&ctx->gc_env_map, frame->env_i);
+        }
+        if (frame->closure_i >= 0) {
+            frame->closure_i =
+                gc_rewrite_index(&ctx->gc_closure_map, frame->closure_i);
+        }
+        frame->upvals = closure_upvals(ctx, frame->closure_i);
+    }
 }
 
-static void extern_frame_reject(Ctx *ctx, const char *message) {
-    assert(ctx->extern_calling);
-    ctx->extern_frame.err = true;
-    ctx->extern_frame.err_message = message;
+// 生き残った文字列のバッファなどのバイト数を数え直して、次に GC を実行する量を決める。
+static void gc_count_malloc_live(Ctx *ctx) {
+    size_t bytes = 0;
+    for (int i = 0; i < ctx->strs.len; i++) {
+        bytes += ctx->strs.data[i].capacity + 1;
+    }
+    for (int i = 0; i < ctx->arrays.len; i++) {
+        bytes += (size_t)ctx->arrays.data[i].ints_capacity * sizeof(int);
+    }
+
+    ctx->gc_malloc_bytes = bytes;
+    ctx->gc_malloc_threshold = bytes * 2;
+    if (ctx->gc_malloc_threshold < gc_malloc_threshold_min) {
+        ctx->gc_malloc_threshold = gc_malloc_threshold_min;
+    }
 }
 
-static Array *extern_frame_args(Ctx *ctx) {
-    assert(ctx->extern_calling);
-    return array_get(ctx, ctx->extern_frame.arg_array_i);
+static void gc_run(Ctx *ctx) {
+    assert(!ctx->extern_calling);
+
+    gc_begin(ctx);
+
+    gc_mark_roots(ctx);
+    gc_mark_loop(ctx);
+
+    gc_move_all(ctx);
+    gc_rewrite_all(ctx);
+    gc_count_malloc_live(ctx);
+
+    // 生きている参照セルがヒープの大半を占めているなら、
+    // GC が頻発しないようにヒープを拡張しておく。
+    int heap_len = ctx->cells.len - stack_len_min;
+    if (heap_len < ctx->heap_len_max &&
+        ctx->cells.len - ctx->heap_end <= ctx->gc_threshold) {
+        int new_heap_len = heap_len <= ctx->heap_len_max / 2
+                               ? heap_len * 2
+                               : ctx->heap_len_max;
+        heap_grow(ctx, new_heap_len);
+    }
+    ctx->does_gc = false;
+
+    // 上限まで拡張したヒープでは、実際に空いている領域の半分を使ったら次の GC を行う。
+    // 空きがほとんど残らないなら、GC を繰り返しても進まないのでメモリ不足とする。
+    heap_len = ctx->cells.len - stack_len_min;
+    if (heap_len >= ctx->heap_len_max) {
+        int free_len = ctx->cells.len - ctx->heap_end;
+        if (free_len < heap_len / gc_free_ratio_min) {
+            eval_abort(ctx, "OUT OF MEMORY", eval_current_tok_i(ctx));
+            return;
+        }
+        ctx->gc_threshold = free_len / 2;
+    }
 }
 
 // -----------------------------------------------
@@ -2083,6 +3639,7 @@ static void eval_abort(Ctx *ctx, const char *message, int tok_i) {
     err_add(ctx, message, tok->src_l, tok->src_r);
 
     ctx->exit_code = 1;
+    ctx->aborted = true;
     ctx->stack_end = 0;
     stack_push(ctx, (Cell){.ty = ty_int, .val = 1});
     ctx->pc = ctx->cmd_i_exit;
@@ -2103,26 +3660,12 @@ static void eval_err(Ctx *ctx, int cmd_i) {
     eval_abort(ctx, data_get(ctx, cmd->x), cmd->tok_i);
 }
 
-static void eval_push_int(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_push_int);
-    stack_push(ctx, (Cell){.ty = ty_int, .val = cmd->x});
-}
-
-static void eval_push_str(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_push_str);
-
-    int str_i = str_add(ctx, data_get(ctx, cmd->x));
-    stack_push(ctx, (Cell){.ty = ty_str, .val = str_i});
-}
-
 static void eval_push_array(Ctx *ctx, int cmd_i) {
     defcmd;
     assert(cmd->kind == cmd_push_array);
 
     int len = cmd->x;
-    int array_i = array_add(ctx, 0, len);
+    int array_i = array_add_packed(ctx, len);
     stack_push(ctx, (Cell){.ty = ty_array, .val = array_i});
 }
 
@@ -2131,533 +3674,2234 @@ static void eval_push_closure(Ctx *ctx, int cmd_i) {
     assert(cmd->kind == cmd_push_closure);
 
     int fun_i = cmd->x;
-    int env_i = frame_current(ctx)->env_i;
-    int closure_i = closure_add(ctx, fun_i, env_i);
+    const Fun *fun = fun_get(ctx, fun_i);
+
+    // 捕獲する変数の参照セルを集める。変数そのものは元の場所に残るので、
+    // 代入はクロージャと生成した関数の間で共有される。
+    int array_i = array_add(ctx, fun->upval_len, fun->upval_len);
+    for (int i = 0; i < fun->upval_len; i++) {
+        const Upval *upval = &ctx->upvals.data[fun->upval_l + i];
+        int cell_i = frame_var_cell_i(
+            ctx, upval->from_local ? var_local : var_upval, upval->index);
+        array_set_item(ctx, array_i, i, (Cell){.ty = ty_cell, .val = cell_i});
+
+        // 捕獲されるローカル変数は、スタック領域ではなく環境にある。
+        if (upval->from_local) {
+            const Frame *frame = frame_current(ctx);
+            assert(frame->base < 0);
+            env_get(ctx, frame->env_i)->captured = true;
+        }
+    }
+
+    int closure_i = closure_add(ctx, fun_i, array_i);
     stack_push(ctx, (Cell){.ty = ty_closure, .val = closure_i});
 }
 
-static void eval_push_extern(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_push_extern);
+// 外部関数を呼び出して、結果をスタックの result_i の位置に置く。
+// 引数はスタックの arg_l から len 個並んでいて、そのまま外部関数に貸し出す。
+static void eval_extern_fun(Ctx *ctx, int extern_fun_i, int arg_l, int len,
+                            int result_i, int tok_i) {
+    const ExternFun *extern_fun = extern_fun_get(ctx, extern_fun_i);
+    if (extern_fun->arity >= 0 && len != extern_fun->arity) {
+        eval_abort(ctx, "引数の個数が一致しません。", tok_i);
+        return;
+    }
+
+    // 呼び出しの間は引数がスタックに残っていて、GC も起きない。
+    assert(!ctx->extern_calling);
+    ctx->extern_calling = true;
+    Cell result = s_cell_null;
+    const char *err =
+        extern_fun->fun(ctx, ctx->cells.data + arg_l, len, &result);
+    ctx->extern_calling = false;
 
-    int extern_fun_i = cmd->x;
-    stack_push(ctx, (Cell){.ty = ty_extern, .val = extern_fun_i});
+    if (err != NULL) {
+        eval_abort(ctx, err, tok_i);
+        return;
+    }
+
+    ctx->stack_end = result_i;
+    stack_push(ctx, result);
 }
 
-static void eval_push_env(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_push_env);
+// スタックに積まれた引数を、そのまま関数のローカル変数にする。
+// 引数はスタックの base から len 個並んでいて、残りのローカル変数を 0 で初期化する。
+static bool eval_alloc_stack_locals(Ctx *ctx, int fun_i, int base, int len,
+                                    int tok_i) {
+    int local_len = scope_get(ctx, fun_get(ctx, fun_i)->scope_i)->len;
+    if (len > local_len) {
+        eval_abort(ctx, "配列の要素番号が無効です。", tok_i);
+        return false;
+    }
 
-    int level = cmd->x;
-    int env_i = frame_current(ctx)->env_i;
-    while (level > 0) {
-        env_i = env_get(ctx, env_i)->parent;
-        level--;
+    if (base + local_len > stack_len_min) {
+        eval_abort(ctx, "STACK OVERFLOW", tok_i);
+        return false;
     }
-    assert(env_i >= 0);
 
-    stack_push(ctx, (Cell){.ty = ty_env, .val = env_i});
+    memset(ctx->cells.data + base + len, 0, (local_len - len) * sizeof(Cell));
+    ctx->stack_end = base + local_len;
+    return true;
 }
 
-static void eval_local_var(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_local_var);
-
-    Cell env_cell = stack_pop(ctx);
-    assert(env_cell.ty == ty_env);
-    int env_i = env_cell.val;
+// スタックに積まれた引数を、関数の環境にコピーする。
+// 引数はスタックの arg_l から len 個並んでいる。
+static bool eval_env_set_args(Ctx *ctx, int env_i, int arg_l, int len,
+                              int tok_i) {
+    Array *array = array_get(ctx, env_get(ctx, env_i)->array_i);
+    if (len > array->len) {
+        eval_abort(ctx, "配列の要素番号が無効です。", tok_i);
+        return false;
+    }
 
-    int index = cmd->x;
-    int cell_i = array_ref(ctx, env_get(ctx, env_i)->array_i, index);
-    stack_push(ctx, (Cell){.ty = ty_cell, .val = cell_i});
+    memcpy(ctx->cells.data + array->cell_l, ctx->cells.data + arg_l,
+           len * sizeof(Cell));
+    return true;
 }
 
-static void eval_cell_get(Ctx *ctx, int cmd_i) {
+// 関数呼び出し。
+// スタックには関数の値と引数が積まれている。
+// ローカル変数をスタック領域に置く関数では、引数をコピーせずにそのまま使う。
+static void eval_call(Ctx *ctx, int cmd_i) {
     defcmd;
-    assert(cmd->kind == cmd_cell_get);
+    assert(cmd->kind == cmd_call || cmd->kind == cmd_tail_call);
+    int len = cmd->x;
+    int arg_l = ctx->stack_end - len;
+    Cell fun = ctx->cells.data[arg_l - 1];
+
+    if (fun.ty == ty_closure) {
+        int closure_i = fun.val;
+        Closure *closure = closure_get(ctx, closure_i);
+        int fun_i = closure->fun_i;
+        assert(fun_get(ctx, fun_i)->kind == fun_kind_closure);
+
+        int body_cmd_i = fun_get(ctx, fun_i)->cmd_i;
+
+        if (ctx->frames.len >= frame_len_max) {
+            eval_abort(ctx, "STACK OVERFLOW", cmd->tok_i);
+            return;
+        }
+
+        // 環境が捕獲されない関数は、ローカル変数をスタック領域に置く。
+        if (fun_get(ctx, fun_i)->stack_locals) {
+            if (!eval_alloc_stack_locals(ctx, fun_i, arg_l, len, cmd->tok_i)) {
+                return;
+            }
+
+            frame_push(ctx, ctx->pc, -1, arg_l, closure_i, cmd->tok_i);
+            ctx->pc = body_cmd_i;
+            return;
+        }
+
+        // ローカル環境を生成する。
+        int env_i = env_add(ctx, fun_i);
+        if (!eval_env_set_args(ctx, env_i, arg_l, len, cmd->tok_i)) {
+            return;
+        }
+        ctx->stack_end = arg_l - 1;
+
+        frame_push(ctx, ctx->pc, env_i, -1, closure_i, cmd->tok_i);
+        ctx->pc = body_cmd_i;
+        return;
+    }
 
-    Cell cell = stack_pop(ctx);
-    if (cell.ty != ty_cell) {
-        eval_abort(ctx, "左辺値が必要です。", cmd->tok_i);
+    if (fun.ty == ty_extern) {
+        eval_extern_fun(ctx, fun.val, arg_l, len, arg_l - 1, cmd->tok_i);
         return;
     }
 
-    stack_push(ctx, ctx->cells.data[cell.val]);
+    eval_abort(ctx, "型エラー", cmd->tok_i);
 }
 
-static void eval_cell_set(Ctx *ctx, int cmd_i) {
+// 末尾呼び出し。
+// クロージャなら、現在のフレームの環境を置き換えて関数の入り口にジャンプする。
+// 戻り先は現在のフレームのものを引き継ぐので、フレームは増えない。
+static void eval_tail_call(Ctx *ctx, int cmd_i) {
     defcmd;
-    assert(cmd->kind == cmd_cell_set);
-
-    Cell r_cell = stack_pop(ctx);
-    Cell l_cell = stack_pop(ctx);
+    assert(cmd->kind == cmd_tail_call);
+    int len = cmd->x;
+    int arg_l = ctx->stack_end - len;
 
-    if (l_cell.ty != ty_cell) {
-        eval_abort(ctx, "左辺値が必要です。", cmd->tok_i);
+    // トップレベルのフレームは置き換えずに、通常の呼び出しとして扱う。
+    // 戻り先はトップレベルのフレームの戻り先とする。
+    if (ctx->frames.len == 1) {
+        ctx->pc = frame_current(ctx)->cmd_i;
+        eval_call(ctx, cmd_i);
         return;
     }
 
-    ctx->cells.data[l_cell.val] = r_cell;
-    stack_push(ctx, r_cell);
-}
+    // 呼び出し元のローカル変数がスタック領域にあるなら、ここで破棄する。
+    // 関数の値と引数を呼び出し元の関数の値の位置に詰めるので、
+    // 呼び出し先の結果は、呼び出し元の結果と同じ位置に置かれる。
+    int caller_base = frame_current(ctx)->base;
+    if (caller_base >= 0) {
+        memmove(ctx->cells.data + caller_base - 1, ctx->cells.data + arg_l - 1,
+                (len + 1) * sizeof(Cell));
+        arg_l = caller_base;
+        ctx->stack_end = arg_l + len;
+    }
 
-static void eval_label(Ctx *ctx, int cmd_i) {}
+    Cell fun = ctx->cells.data[arg_l - 1];
 
-static void eval_jump_unless(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_jump_unless);
+    if (fun.ty == ty_closure) {
+        int closure_i = fun.val;
+        int fun_i = closure_get(ctx, closure_i)->fun_i;
+        assert(fun_get(ctx, fun_i)->kind == fun_kind_closure);
+
+        int env_i = -1;
+        int base = -1;
+        if (fun_get(ctx, fun_i)->stack_locals) {
+            if (!eval_alloc_stack_locals(ctx, fun_i, arg_l, len, cmd->tok_i)) {
+                return;
+            }
+            base = arg_l;
+        } else {
+            // 呼び出し元の環境は、環境に置かれている場合のみ再利用できる。
+            if (caller_base < 0) {
+                env_i = env_reuse(ctx, frame_current(ctx)->env_i, fun_i);
+            }
+            if (env_i < 0) {
+                env_i = env_add(ctx, fun_i);
+            }
 
-    int label_i = cmd->x;
+            if (!eval_env_set_args(ctx, env_i, arg_l, len, cmd->tok_i)) {
+                return;
+            }
+            ctx->stack_end = arg_l - 1;
+        }
 
-    Cell cond = stack_pop(ctx);
-    if (cond.ty != ty_int) {
-        eval_abort(ctx, "条件は整数でなければいけません。", cmd->tok_i);
+        Frame *frame = frame_current(ctx);
+        frame->env_i = env_i;
+        frame->base = base;
+        frame->closure_i = closure_i;
+        frame->upvals = closure_upvals(ctx, closure_i);
+        frame->tok_i = cmd->tok_i;
+        ctx->pc = fun_get(ctx, fun_i)->cmd_i;
         return;
     }
 
-    if (cond.val == 0) {
-        ctx->pc = ctx->labels.data[label_i].cmd_i;
-        assert(ctx->cmds.data[ctx->pc].kind == cmd_label);
+    if (fun.ty == ty_extern) {
+        eval_extern_fun(ctx, fun.val, arg_l, len, arg_l - 1, cmd->tok_i);
+        if (!ctx->aborted) {
+            ctx->pc = frame_pop(ctx)->cmd_i;
+        }
+        return;
     }
+
+    eval_abort(ctx, "型エラー", cmd->tok_i);
 }
 
-static void eval_pop(Ctx *ctx, int cmd_i) {
+static void eval_call_extern(Ctx *ctx, int cmd_i) {
     defcmd;
-    assert(cmd->kind == cmd_pop);
+    assert(cmd->kind == cmd_call_extern);
+    int len = cmd->x;
+    int arg_l = ctx->stack_end - len;
 
-    stack_pop(ctx);
+    eval_extern_fun(ctx, cmd->y, arg_l, len, arg_l, cmd->tok_i);
+}
+
+static void eval_str_slice(Ctx *ctx, int cmd_i) {
+    defcmd;
+    assert(cmd->kind == cmd_str_slice);
+
+    Cell r = stack_pop(ctx);
+    Cell l = stack_pop(ctx);
+    Cell str = stack_pop(ctx);
+    if (str.ty != ty_str || l.ty != ty_int || r.ty != ty_int) {
+        eval_abort(ctx, "str_slice error", cmd->tok_i);
+        return;
+    }
+
+    int str_slice_i = str_slice_fun(ctx, str.val, l.val, r.val);
+    stack_push(ctx, (Cell){.ty = ty_str, .val = str_slice_i});
+}
+
+static void eval_array_push(Ctx *ctx, int cmd_i) {
+    defcmd;
+    assert(cmd->kind == cmd_array_push);
+
+    Cell item = stack_pop(ctx);
+    Cell array = stack_pop(ctx);
+    if (array.ty != ty_array) {
+        eval_abort(ctx, "array_push error", cmd->tok_i);
+        return;
+    }
+
+    array_push(ctx, array.val, item);
+    stack_push(ctx, s_cell_null);
+}
+
+// スタックの上から2つの値を下ろして、演算の結果をプッシュする。
+static void eval_op_kind(Ctx *ctx, OpKind op, int tok_i) {
+    assert(op != op_semi);
+
+    // l != r ---> !(l == r)
+    // l <= r ---> !(r < l)
+    // l > r ---> r < l
+    // l >= r ---> !(l < r)
+    if (op == op_ne || op == op_le || op == op_gt || op == op_ge) {
+        if (op == op_le || op == op_gt) {
+            Cell *cells = ctx->cells.data + ctx->stack_end - 2;
+            Cell t = cells[0];
+            cells[0] = cells[1];
+            cells[1] = t;
+        }
+
+        eval_op_kind(ctx, op == op_ne ? op_eq : op_lt, tok_i);
+
+        if (!ctx->aborted && op != op_gt) {
+            Cell *top = &ctx->cells.data[ctx->stack_end - 1];
+            *top = cell_from_bool(top->ty == ty_int && top->val == 0);
+        }
+        return;
+    }
+
+    Cell r_cell = stack_pop(ctx);
+    Cell l_cell = stack_pop(ctx);
+    int ty = l_cell.ty;
+    int val = l_cell.val;
+
+    if (op == op_eq) {
+        if (ty != r_cell.ty) {
+            stack_push(ctx, s_cell_null);
+            return;
+        }
+        if (ty == ty_int) {
+            stack_push(ctx, cell_from_bool(val == r_cell.val));
+            return;
+        }
+        if (ty == ty_str) {
+            bool cmp =
+                strcmp(str_get(ctx, val)->data, str_get(ctx, r_cell.val)->data);
+            stack_push(ctx, cell_from_bool(cmp == 0));
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+
+    if (op == op_lt) {
+        if (ty != r_cell.ty) {
+            stack_push(ctx, cell_from_bool(ty < r_cell.ty));
+            return;
+        }
+        if (ty == ty_int) {
+            stack_push(ctx, cell_from_bool(val < r_cell.val));
+            return;
+        }
+        if (ty == ty_str) {
+            int cmp =
+                strcmp(str_get(ctx, val)->data, str_get(ctx, r_cell.val)->data);
+            stack_push(ctx, cell_from_bool(cmp < 0));
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+
+    if (op == op_index) {
+        if (ty == ty_str && r_cell.ty == ty_int) {
+            int i = r_cell.val;
+            const Str *str = str_get(ctx, val);
+            char c = 0 <= i && i < str->len ? str->data[i] : '\0';
+            stack_push(ctx, (Cell){.ty = ty_int, .val = (int)c});
+            return;
+        }
+        if (ty == ty_array && r_cell.ty == ty_int) {
+            Cell item = array_get_item(ctx, val, r_cell.val);
+            stack_push(ctx, item);
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+    if (op == op_index_ref) {
+        if (ty == ty_array && r_cell.ty == ty_int) {
+            int cell_i = array_ref(ctx, val, r_cell.val);
+            stack_push(ctx, (Cell){.ty = ty_cell, .val = cell_i});
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+    if (op == op_array_push) {
+        // コンパイラは配列に対してだけ生成するが、読み込んだイメージでは保証されない。
+        if (ty != ty_array) {
+            eval_abort(ctx, "型エラー", tok_i);
+            return;
+        }
+        array_push(ctx, val, r_cell);
+        stack_push(ctx, l_cell);
+        return;
+    }
+
+    if (ty != r_cell.ty) {
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+
+    if (op == op_add) {
+        if (ty == ty_int) {
+            stack_push(ctx, (Cell){.ty = ty_int, .val = val + r_cell.val});
+            return;
+        }
+        if (ty == ty_str) {
+            int str_i = str_concat(ctx, val, r_cell.val);
+            stack_push(ctx, (Cell){.ty = ty_str, .val = str_i});
+            return;
+        }
+        eval_abort(ctx, "演算子 + をサポートしていません。", tok_i);
+        return;
+    }
+
+    if (op == op_sub) {
+        if (ty == ty_int) {
+            stack_push(ctx, (Cell){.ty = ty_int, .val = val - r_cell.val});
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+    if (op == op_mul) {
+        if (ty == ty_int) {
+            stack_push(ctx, (Cell){.ty = ty_int, .val = val * r_cell.val});
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+    if (op == op_div) {
+        if (ty == ty_int) {
+            stack_push(ctx, (Cell){.ty = ty_int, .val = val / r_cell.val});
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+    if (op == op_mod) {
+        if (ty == ty_int) {
+            stack_push(ctx, (Cell){.ty = ty_int, .val = val % r_cell.val});
+            return;
+        }
+        eval_abort(ctx, "型エラー", tok_i);
+        return;
+    }
+
+    failwith("Unknown OpKind");
 }
 
-static void eval_swap(Ctx *ctx, int cmd_i) {
+static void eval_op(Ctx *ctx, int cmd_i) {
+    defcmd;
+    assert(cmd->kind == cmd_op);
+
+    eval_op_kind(ctx, (OpKind)cmd->x, cmd->tok_i);
+}
+
+// 比較してジャンプする命令の、オペランドが整数でない場合の処理。
+static void eval_jump_cmp(Ctx *ctx, int cmd_i) {
+    defcmd;
+
+    eval_op_kind(ctx, cmd_jump_cmp_op(cmd->kind), cmd->tok_i);
+    if (ctx->aborted) {
+        return;
+    }
+
+    Cell cond = stack_pop(ctx);
+    assert(cond.ty == ty_int);
+    if (cond.val != 0) {
+        ctx->pc = cmd->x;
+    }
+}
+
+// 配列の要素に代入する。複合代入なら、元の値と演算した結果を代入する。
+static void eval_index_set(Ctx *ctx, int cmd_i) {
     defcmd;
-    assert(cmd->kind == cmd_swap);
+    assert(cmd->kind == cmd_index_set || cmd->kind == cmd_index_set_pop);
+    OpKind op = cmd->x;
+
+    Cell value = stack_pop(ctx);
+    Cell index = stack_pop(ctx);
+    Cell array = stack_pop(ctx);
+    if (array.ty != ty_array || index.ty != ty_int) {
+        eval_abort(ctx, "型エラー", cmd->tok_i);
+        return;
+    }
+
+    if (op != op_set) {
+        stack_push(ctx, array_get_item(ctx, array.val, index.val));
+        stack_push(ctx, value);
+        if (ctx->aborted) {
+            return;
+        }
+
+        eval_op_kind(ctx, op, cmd->tok_i);
+        if (ctx->aborted) {
+            return;
+        }
+        value = stack_pop(ctx);
+    }
+
+    array_set_item(ctx, array.val, index.val, value);
+    if (cmd->kind == cmd_index_set) {
+        stack_push(ctx, value);
+    }
+}
+
+// 変数から積んだ文字列が、cmd_i 以降の命令によって変数の外に持ち出されずに消費されるか。
+// 比較などの結果は新しい値なので、その場合は変数が文字列を所有し続けてよい。
+// 間に積まれるのが定数や変数の値だけで、それらと一緒に消費される場合に限る。
+static bool eval_str_is_consumed(Ctx *ctx, int cmd_i) {
+    // 文字列より上に積まれた値の個数
+    int depth = 0;
+
+    for (int i = cmd_i; i < ctx->cmds.len; i++) {
+        const Cmd *cmd = &ctx->cmds.data[i];
+        switch (cmd->kind) {
+        case cmd_push_int:
+        case cmd_push_str:
+        case cmd_load_local:
+        case cmd_load_global:
+            depth++;
+            if (depth >= 3) {
+                return false;
+            }
+            continue;
+        case cmd_val_type:
+            return depth < 1;
+        case cmd_str_slice:
+            return depth < 3;
+        case cmd_jump_if_eq:
+        case cmd_jump_if_ne:
+        case cmd_jump_if_lt:
+        case cmd_jump_if_le:
+        case cmd_jump_if_gt:
+        case cmd_jump_if_ge:
+        case cmd_op_add_int:
+        case cmd_op_sub_int:
+        case cmd_op_mul_int:
+        case cmd_op_eq_int:
+        case cmd_op_ne_int:
+        case cmd_op_lt_int:
+        case cmd_op_le_int:
+        case cmd_op_gt_int:
+        case cmd_op_ge_int:
+        case cmd_op_index_packed:
+            return depth < 2;
+        case cmd_op:
+            return ((op_eq <= cmd->x && cmd->x <= op_mod) ||
+                    cmd->x == op_index) &&
+                   depth < 2;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// 文字列のローカル変数への加算代入。
+// 変数が文字列を所有しているなら、その場で追記する。そうでなければ、
+// 変数が所有する複製を作ってから追記する。複製のキャパシティを大きめにとるので、
+// 同じ変数への加算代入の繰り返しは、償却して追記する長さに比例する時間で済む。
+static void eval_inc_local_str(Ctx *ctx, int cell_i) {
+    Cell r_cell = stack_pop(ctx);
+    int str_i = ctx->cells.data[cell_i].val;
+
+    if (str_get(ctx, str_i)->owner != cell_i || str_i == r_cell.val) {
+        const Str *str = str_get(ctx, str_i);
+        int len = str->len + str_get(ctx, r_cell.val)->len;
+        str_i = str_add_len(ctx, str->data, str->len, len * 2);
+        str_get(ctx, str_i)->owner = cell_i;
+    }
 
-    // HELP: optimize
-    Cell first = stack_pop(ctx);
-    Cell second = stack_pop(ctx);
-    stack_push(ctx, first);
-    stack_push(ctx, second);
+    const Str *r = str_get(ctx, r_cell.val);
+    str_append(ctx, str_i, r->data, r->len);
+
+    Cell result = (Cell){.ty = ty_str, .val = str_i};
+    ctx->cells.data[cell_i] = result;
+    stack_push(ctx, result);
+
+    // 結果がすぐに捨てられないなら、文字列は変数以外からも参照される。
+    if (ctx->cmds.data[ctx->pc].kind != cmd_pop) {
+        str_get(ctx, str_i)->owner = -1;
+    }
 }
 
-static void eval_dup(Ctx *ctx, int cmd_i) {
+// 整数以外の値に対する cmd_inc_local
+static void eval_inc_local(Ctx *ctx, int cmd_i) {
     defcmd;
-    assert(cmd->kind == cmd_dup);
+    assert(cmd->kind == cmd_inc_local);
+
+    int cell_i = frame_var_cell_i(ctx, cmd->y, cmd->x);
+
+    Cell l_cell = ctx->cells.data[cell_i];
+    Cell r_cell = ctx->cells.data[ctx->stack_end - 1];
+    if (l_cell.ty == ty_str && r_cell.ty == ty_str) {
+        eval_inc_local_str(ctx, cell_i);
+        return;
+    }
+
+    stack_pop(ctx);
+    stack_push(ctx, ctx->cells.data[cell_i]);
+    stack_push(ctx, r_cell);
+    eval_op_kind(ctx, op_add, cmd->tok_i);
+
+    if (!ctx->aborted) {
+        ctx->cells.data[cell_i] = ctx->cells.data[ctx->stack_end - 1];
+    }
+}
+
+// -----------------------------------------------
+// 評価: メインループ
+// -----------------------------------------------
+
+// GCC と Clang では、命令リストを各命令の処理のアドレスのリストに変換しておき、
+// 処理の末尾から次の命令の処理へ直接ジャンプする。(direct threading)
+// それ以外のコンパイラでは switch 文で分岐する。
+#if (defined(__GNUC__) || defined(__clang__)) &&                               \
+    !defined(NEGI_LANG_NO_THREADED)
+#define NEGI_LANG_THREADED
+#endif
+
+static void eval_cmds(Ctx *ctx) {
+    // 頻繁に参照する値はローカル変数に置いておく。
+    // 関数を呼ぶ前に vm_save で書き戻し、呼んだ後に vm_load で読み直す。
+    // (ヒープ領域の拡張により、参照セルリストの位置は変わることがある。)
+    Cmd *cmds = ctx->cmds.data;
+    int pc = ctx->pc;
+    int stack_end = ctx->stack_end;
+    Cell *cells = ctx->cells.data;
+    int cmd_i;
+
+#define vm_save() (ctx->pc = pc, ctx->stack_end = stack_end)
+#define vm_load()                                                              \
+    (pc = ctx->pc, stack_end = ctx->stack_end, cells = ctx->cells.data)
+
+#ifdef NEGI_LANG_THREADED
+    static const void *const handlers[] = {
+        [cmd_err] = &&vm_cmd_err,
+        [cmd_exit] = &&vm_cmd_exit,
+        [cmd_jump] = &&vm_cmd_jump,
+        [cmd_jump_unless] = &&vm_cmd_jump_unless,
+        [cmd_jump_if] = &&vm_cmd_jump_if,
+        [cmd_jump_if_eq] = &&vm_cmd_jump_if_eq,
+        [cmd_jump_if_ne] = &&vm_cmd_jump_if_ne,
+        [cmd_jump_if_lt] = &&vm_cmd_jump_if_lt,
+        [cmd_jump_if_le] = &&vm_cmd_jump_if_le,
+        [cmd_jump_if_gt] = &&vm_cmd_jump_if_gt,
+        [cmd_jump_if_ge] = &&vm_cmd_jump_if_ge,
+        [cmd_push_int] = &&vm_cmd_push_int,
+        [cmd_push_str] = &&vm_cmd_push_str,
+        [cmd_push_array] = &&vm_cmd_push_array,
+        [cmd_push_closure] = &&vm_cmd_push_closure,
+        [cmd_push_extern] = &&vm_cmd_push_extern,
+        [cmd_local_ref] = &&vm_cmd_local_ref,
+        [cmd_load_local] = &&vm_cmd_load_local,
+        [cmd_store_local] = &&vm_cmd_store_local,
+        [cmd_store_local_pop] = &&vm_cmd_store_local_pop,
+        [cmd_load_global] = &&vm_cmd_load_global,
+        [cmd_store_global] = &&vm_cmd_store_global,
+        [cmd_store_global_pop] = &&vm_cmd_store_global_pop,
+        [cmd_inc_local] = &&vm_cmd_inc_local,
+        [cmd_cell_get] = &&vm_cmd_cell_get,
+        [cmd_cell_set] = &&vm_cmd_cell_set,
+        [cmd_cell_set_pop] = &&vm_cmd_cell_set_pop,
+        [cmd_index_set] = &&vm_cmd_index_set,
+        [cmd_index_set_pop] = &&vm_cmd_index_set_pop,
+        [cmd_pop] = &&vm_cmd_pop,
+        [cmd_swap] = &&vm_cmd_swap,
+        [cmd_dup] = &&vm_cmd_dup,
+        [cmd_call] = &&vm_cmd_call,
+        [cmd_tail_call] = &&vm_cmd_tail_call,
+        [cmd_call_extern] = &&vm_cmd_call_extern,
+        [cmd_val_type] = &&vm_cmd_val_type,
+        [cmd_str_slice] = &&vm_cmd_str_slice,
+        [cmd_array_len] = &&vm_cmd_array_len,
+        [cmd_array_push] = &&vm_cmd_array_push,
+        [cmd_array_pop] = &&vm_cmd_array_pop,
+        [cmd_return] = &&vm_cmd_return,
+        [cmd_op] = &&vm_cmd_op,
+        [cmd_op_add_int] = &&vm_cmd_op_add_int,
+        [cmd_op_sub_int] = &&vm_cmd_op_sub_int,
+        [cmd_op_mul_int] = &&vm_cmd_op_mul_int,
+        [cmd_op_eq_int] = &&vm_cmd_op_eq_int,
+        [cmd_op_ne_int] = &&vm_cmd_op_ne_int,
+        [cmd_op_lt_int] = &&vm_cmd_op_lt_int,
+        [cmd_op_le_int] = &&vm_cmd_op_le_int,
+        [cmd_op_gt_int] = &&vm_cmd_op_gt_int,
+        [cmd_op_ge_int] = &&vm_cmd_op_ge_int,
+        [cmd_op_index_packed] = &&vm_cmd_op_index_packed,
+    };
+
+    // 命令リストを処理のアドレスのリストに変換する。
+    if (ctx->code_len != ctx->cmds.len) {
+        mem_reserve((void **)&ctx->code, 0, sizeof(void *),
+                    &ctx->code_capacity, ctx->cmds.len);
+        for (int i = 0; i < ctx->cmds.len; i++) {
+            CmdKind kind = cmds[i].kind;
+            if (!(0 <= kind && kind < array_len(handlers) &&
+                  handlers[kind] != NULL)) {
+                failwith("Unknown CmdKind");
+            }
+            ctx->code[i] = handlers[kind];
+        }
+        ctx->code_len = ctx->cmds.len;
+    }
+    const void **code = ctx->code;
+
+#define vm_case(kind) vm_##kind
+#define vm_next()                                                              \
+    do {                                                                       \
+        cmd_i = pc++;                                                          \
+        goto *code[cmd_i];                                                     \
+    } while (0)
+
+    // 命令の種類を書き換える。
+#define vm_rewrite(new_kind)                                                   \
+    (cmds[cmd_i].kind = (new_kind), code[cmd_i] = handlers[new_kind])
+#else
+#define vm_case(kind) case kind
+#define vm_next() goto vm_dispatch
+#define vm_rewrite(new_kind) (cmds[cmd_i].kind = (new_kind))
+#endif
+
+    // 命令の処理を関数に任せる。命令の直後は GC を実行してよいタイミングである。
+#define vm_call(eval_fun)                                                      \
+    do {                                                                       \
+        vm_save();                                                             \
+        eval_fun(ctx, cmd_i);                                                  \
+        if (ctx->does_gc) {                                                    \
+            gc_run(ctx);                                                       \
+        }                                                                      \
+        vm_load();                                                             \
+        vm_next();                                                             \
+    } while (0)
+
+#define vm_abort(message)                                                      \
+    do {                                                                       \
+        vm_save();                                                             \
+        eval_abort(ctx, message, cmds[cmd_i].tok_i);                           \
+        vm_load();                                                             \
+        vm_next();                                                             \
+    } while (0)
+
+#define vm_push(cell)                                                          \
+    do {                                                                       \
+        if (stack_end >= stack_len_min) {                                      \
+            vm_abort("STACK OVERFLOW");                                        \
+        }                                                                      \
+        cells[stack_end++] = (cell);                                           \
+    } while (0)
+
+#define vm_pop() (assert(stack_end >= 1), cells[--stack_end])
+
+#define vm_top() (assert(stack_end >= 1), &cells[stack_end - 1])
+
+    // 整数どうしなら直接計算する。
+    // そうでなければ汎用の cmd_op に戻し、以降は書き換えないようにする。
+#define vm_op_int(op)                                                          \
+    do {                                                                       \
+        assert(stack_end >= 2);                                                \
+        Cell *l = &cells[stack_end - 2];                                       \
+        Cell *r = &cells[stack_end - 1];                                       \
+        if (!(l->ty == ty_int && r->ty == ty_int)) {                           \
+            cmds[cmd_i].y = 1;                                                 \
+            vm_rewrite(cmd_op);                                                \
+            vm_call(eval_op);                                                  \
+        }                                                                      \
+                                                                               \
+        l->val = l->val op r->val;                                             \
+        stack_end--;                                                           \
+        vm_next();                                                             \
+    } while (0)
+
+    // 詰めた配列への整数の代入なら直接設定する。
+    // そうでなければ eval_index_set に任せる。
+#define vm_index_set(keep)                                                     \
+    do {                                                                       \
+        assert(stack_end >= 3);                                                \
+        Cell *array = &cells[stack_end - 3];                                   \
+        Cell *index = &cells[stack_end - 2];                                   \
+        Cell *value = &cells[stack_end - 1];                                   \
+        if (cmds[cmd_i].x == op_set && array->ty == ty_array &&               \
+            index->ty == ty_int && value->ty == ty_int) {                      \
+            Array *a = &ctx->arrays.data[array->val];                          \
+            if (a->packed && 0 <= index->val && index->val < a->len) {         \
+                a->ints[index->val] = value->val;                              \
+                *array = *value;                                               \
+                stack_end -= (keep) ? 2 : 3;                                   \
+                vm_next();                                                     \
+            }                                                                  \
+        }                                                                      \
+        vm_call(eval_index_set);                                               \
+    } while (0)
+
+    // 整数どうしの比較なら直接ジャンプする。
+#define vm_jump_cmp(cmp)                                                       \
+    do {                                                                       \
+        assert(stack_end >= 2);                                                \
+        Cell *l = &cells[stack_end - 2];                                       \
+        Cell *r = &cells[stack_end - 1];                                       \
+        if (!(l->ty == ty_int && r->ty == ty_int)) {                           \
+            vm_call(eval_jump_cmp);                                            \
+        }                                                                      \
+                                                                               \
+        stack_end -= 2;                                                        \
+        if (l->val cmp r->val) {                                               \
+            pc = cmds[cmd_i].x;                                                \
+        }                                                                      \
+        vm_next();                                                             \
+    } while (0)
+
+#ifdef NEGI_LANG_THREADED
+    vm_next();
+#else
+vm_dispatch:
+    cmd_i = pc++;
+    switch (cmds[cmd_i].kind) {
+#endif
+
+    vm_case(cmd_push_int) : {
+        vm_push(((Cell){.ty = ty_int, .val = cmds[cmd_i].x}));
+        vm_next();
+    }
+    vm_case(cmd_push_str) : {
+        vm_push(((Cell){.ty = ty_str, .val = cmds[cmd_i].x}));
+        vm_next();
+    }
+    vm_case(cmd_push_array) : vm_call(eval_push_array);
+    vm_case(cmd_push_closure) : vm_call(eval_push_closure);
+    vm_case(cmd_push_extern) : {
+        vm_push(((Cell){.ty = ty_extern, .val = cmds[cmd_i].x}));
+        vm_next();
+    }
+    vm_case(cmd_local_ref) : {
+        int cell_i = frame_var_cell_i(ctx, cmds[cmd_i].y, cmds[cmd_i].x);
+        vm_push(((Cell){.ty = ty_cell, .val = cell_i}));
+        vm_next();
+    }
+    vm_case(cmd_load_local) : {
+        int cell_i = frame_var_cell_i(ctx, cmds[cmd_i].y, cmds[cmd_i].x);
+        Cell value = cells[cell_i];
+
+        // 変数の外に文字列がコピーされるなら、所有者がいなくなる。
+        if (value.ty == ty_str && !eval_str_is_consumed(ctx, cmd_i + 1)) {
+            ctx->strs.data[value.val].owner = -1;
+        }
+
+        vm_push(value);
+        vm_next();
+    }
+    vm_case(cmd_store_local) : {
+        int cell_i = frame_var_cell_i(ctx, cmds[cmd_i].y, cmds[cmd_i].x);
+        cells[cell_i] = *vm_top();
+        vm_next();
+    }
+    vm_case(cmd_store_local_pop) : {
+        int cell_i = frame_var_cell_i(ctx, cmds[cmd_i].y, cmds[cmd_i].x);
+        cells[cell_i] = vm_pop();
+        vm_next();
+    }
+    vm_case(cmd_load_global) : {
+        Cell value = cells[stack_len_min + cmds[cmd_i].x];
+
+        // 変数の外に文字列がコピーされるなら、所有者がいなくなる。
+        if (value.ty == ty_str && !eval_str_is_consumed(ctx, cmd_i + 1)) {
+            ctx->strs.data[value.val].owner = -1;
+        }
+
+        vm_push(value);
+        vm_next();
+    }
+    vm_case(cmd_store_global) : {
+        cells[stack_len_min + cmds[cmd_i].x] = *vm_top();
+        vm_next();
+    }
+    vm_case(cmd_store_global_pop) : {
+        cells[stack_len_min + cmds[cmd_i].x] = vm_pop();
+        vm_next();
+    }
+    vm_case(cmd_inc_local) : {
+        int cell_i = frame_var_cell_i(ctx, cmds[cmd_i].y, cmds[cmd_i].x);
+        Cell *top = vm_top();
+        if (!(cells[cell_i].ty == ty_int && top->ty == ty_int)) {
+            vm_call(eval_inc_local);
+        }
+
+        cells[cell_i].val += top->val;
+        *top = cells[cell_i];
+        vm_next();
+    }
+    vm_case(cmd_cell_get) : {
+        Cell *top = vm_top();
+        if (top->ty != ty_cell) {
+            vm_abort("左辺値が必要です。");
+        }
+
+        *top = cells[top->val];
+        if (top->ty == ty_str && !eval_str_is_consumed(ctx, cmd_i + 1)) {
+            ctx->strs.data[top->val].owner = -1;
+        }
+        vm_next();
+    }
+    vm_case(cmd_cell_set) : {
+        Cell r_cell = vm_pop();
+        Cell *top = vm_top();
+        if (top->ty != ty_cell) {
+            vm_abort("左辺値が必要です。");
+        }
+
+        cells[top->val] = r_cell;
+        *top = r_cell;
+        vm_next();
+    }
+    vm_case(cmd_cell_set_pop) : {
+        Cell r_cell = vm_pop();
+        Cell l_cell = vm_pop();
+        if (l_cell.ty != ty_cell) {
+            vm_abort("左辺値が必要です。");
+        }
+
+        cells[l_cell.val] = r_cell;
+        vm_next();
+    }
+    vm_case(cmd_index_set) : vm_index_set(1);
+    vm_case(cmd_index_set_pop) : vm_index_set(0);
+    vm_case(cmd_jump) : {
+        pc = cmds[cmd_i].x;
+        vm_next();
+    }
+    vm_case(cmd_jump_unless) : {
+        Cell cond = vm_pop();
+        if (cond.ty != ty_int) {
+            vm_abort("条件は整数でなければいけません。");
+        }
+
+        if (cond.val == 0) {
+            pc = cmds[cmd_i].x;
+        }
+        vm_next();
+    }
+    vm_case(cmd_jump_if) : {
+        Cell cond = vm_pop();
+        if (cond.ty != ty_int) {
+            vm_abort("条件は整数でなければいけません。");
+        }
+
+        if (cond.val != 0) {
+            pc = cmds[cmd_i].x;
+        }
+        vm_next();
+    }
+    vm_case(cmd_jump_if_eq) : vm_jump_cmp(==);
+    vm_case(cmd_jump_if_ne) : vm_jump_cmp(!=);
+    vm_case(cmd_jump_if_lt) : vm_jump_cmp(<);
+    vm_case(cmd_jump_if_le) : vm_jump_cmp(<=);
+    vm_case(cmd_jump_if_gt) : vm_jump_cmp(>);
+    vm_case(cmd_jump_if_ge) : vm_jump_cmp(>=);
+    vm_case(cmd_pop) : {
+        vm_pop();
+        vm_next();
+    }
+    vm_case(cmd_swap) : {
+        assert(stack_end >= 2);
+        Cell first = cells[stack_end - 1];
+        cells[stack_end - 1] = cells[stack_end - 2];
+        cells[stack_end - 2] = first;
+        vm_next();
+    }
+    vm_case(cmd_dup) : {
+        Cell first = *vm_top();
+        vm_push(first);
+        vm_next();
+    }
+    vm_case(cmd_call) : vm_call(eval_call);
+    vm_case(cmd_tail_call) : vm_call(eval_tail_call);
+    vm_case(cmd_call_extern) : vm_call(eval_call_extern);
+    vm_case(cmd_val_type) : {
+        Cell *value = vm_top();
+        *value = (Cell){.ty = ty_int, .val = value->ty};
+        vm_next();
+    }
+    vm_case(cmd_str_slice) : vm_call(eval_str_slice);
+    vm_case(cmd_array_len) : {
+        Cell *array = vm_top();
+        if (array->ty != ty_array) {
+            vm_abort("array_len error");
+        }
+
+        *array = (Cell){.ty = ty_int, .val = ctx->arrays.data[array->val].len};
+        vm_next();
+    }
+    vm_case(cmd_array_push) : vm_call(eval_array_push);
+    vm_case(cmd_array_pop) : {
+        Cell *array = vm_top();
+        if (array->ty != ty_array) {
+            vm_abort("array_pop error");
+        }
+
+        array_pop(ctx, array->val);
+        *array = s_cell_null;
+        vm_next();
+    }
+    vm_case(cmd_return) : {
+        Frame *frame = frame_pop(ctx);
+
+        // ローカル変数がスタック領域にあるなら、戻り値だけを残して破棄する。
+        // 戻り値は、呼ばれた関数の値があった位置に置く。
+        if (frame->base >= 0) {
+            cells[frame->base - 1] = *vm_top();
+            stack_end = frame->base;
+        }
+
+        pc = frame->cmd_i;
+        vm_next();
+    }
+    vm_case(cmd_op) : {
+        // 整数どうしの演算を観測したら、整数専用の命令に書き換えて実行し直す。
+        CmdKind int_kind = op_int_cmd_kind(cmds[cmd_i].x);
+        if (int_kind != cmd_op && cmds[cmd_i].y == 0 &&
+            cells[stack_end - 2].ty == ty_int &&
+            cells[stack_end - 1].ty == ty_int) {
+            vm_rewrite(int_kind);
+            pc = cmd_i;
+            vm_next();
+        }
+
+        // 詰めた配列の要素の取得を観測したら、専用の命令に書き換える。
+        if (cmds[cmd_i].x == op_index && cmds[cmd_i].y == 0 &&
+            cells[stack_end - 2].ty == ty_array &&
+            ctx->arrays.data[cells[stack_end - 2].val].packed &&
+            cells[stack_end - 1].ty == ty_int) {
+            vm_rewrite(cmd_op_index_packed);
+            pc = cmd_i;
+            vm_next();
+        }
+        vm_call(eval_op);
+    }
+    vm_case(cmd_op_add_int) : vm_op_int(+);
+    vm_case(cmd_op_sub_int) : vm_op_int(-);
+    vm_case(cmd_op_mul_int) : vm_op_int(*);
+    vm_case(cmd_op_eq_int) : vm_op_int(==);
+    vm_case(cmd_op_ne_int) : vm_op_int(!=);
+    vm_case(cmd_op_lt_int) : vm_op_int(<);
+    vm_case(cmd_op_le_int) : vm_op_int(<=);
+    vm_case(cmd_op_gt_int) : vm_op_int(>);
+    vm_case(cmd_op_ge_int) : vm_op_int(>=);
+    vm_case(cmd_op_index_packed) : {
+        assert(stack_end >= 2);
+        Cell *l = &cells[stack_end - 2];
+        Cell *r = &cells[stack_end - 1];
+        if (l->ty == ty_array && r->ty == ty_int) {
+            const Array *array = &ctx->arrays.data[l->val];
+            if (array->packed && 0 <= r->val && r->val < array->len) {
+                *l = (Cell){.ty = ty_int, .val = array->ints[r->val]};
+                stack_end--;
+                vm_next();
+            }
+        }
+
+        cmds[cmd_i].y = 1;
+        vm_rewrite(cmd_op);
+        vm_call(eval_op);
+    }
+    vm_case(cmd_err) : vm_call(eval_err);
+    vm_case(cmd_exit) : {
+        vm_save();
+
+        // 命令の途中で中断されたときは、スタックの状態によらず異常終了する。
+        if (ctx->aborted) {
+            ctx->exit_code = 1;
+            return;
+        }
+
+        Cell cell = stack_pop(ctx);
+        if (cell.ty != ty_int) {
+            eval_abort(ctx, "終了コードは整数値でなければいけません。",
+                       eval_current_tok_i(ctx));
+            vm_load();
+            vm_next();
+        }
+        ctx->exit_code = cell.val;
+        return;
+    }
+
+#ifndef NEGI_LANG_THREADED
+    default:
+        failwith("Unknown CmdKind");
+    }
+#endif
+
+#undef vm_save
+#undef vm_load
+#undef vm_case
+#undef vm_next
+#undef vm_call
+#undef vm_abort
+#undef vm_push
+#undef vm_pop
+#undef vm_top
+#undef vm_rewrite
+#undef vm_op_int
+#undef vm_jump_cmp
+#undef vm_index_set
+}
+
+static void eval(Ctx *ctx) {
+    ctx->pc = ctx->cmd_i_entry;
+    ctx->does_gc = false;
+    ctx->aborted = false;
+    ctx->exit_code = 1;
+    ctx->errs.len = ctx->err_len_compile;
+    ctx->extern_calling = false;
+
+    cell_initialize(ctx);
+    str_add_consts(ctx);
+    array_free_all(ctx);
+    ctx->envs.len = 0;
+    ctx->closures.len = 0;
+    ctx->frames.len = 0;
+
+    // グローバル環境を生成する。
+    // 最初にヒープ領域に割り当てられ、常に生存しているので、GC で移動しない。
+    int env_i_global = env_add(ctx, ctx->fun_i_main);
+    assert(scope_get(ctx, ctx->scope_i_global)->len == 0 ||
+           array_get(ctx, env_get(ctx, env_i_global)->array_i)->cell_l ==
+               stack_len_min);
+    ctx->env_i_global = env_i_global;
+    frame_push(ctx, ctx->cmd_i_exit, env_i_global, -1, -1, ctx->tok_i_eof);
+
+    eval_cmds(ctx);
+}
+
+// ###############################################
+// 組み込み関数
+// ###############################################
+
+// 引数の個数は呼び出す前に検査済み。
+
+static const char *builtin_val_type(Ctx *ctx, const Cell *args, int argc,
+                                    Cell *result) {
+    *result = (Cell){.ty = ty_int, .val = args[0].ty};
+    return NULL;
+}
+
+static const char *builtin_str_slice(Ctx *ctx, const Cell *args, int argc,
+                                     Cell *result) {
+    if (args[0].ty != ty_str || args[1].ty != ty_int || args[2].ty != ty_int) {
+        return "str_slice error";
+    }
+
+    int str_i = args[0].val;
+    int l = args[1].val;
+    int r = args[2].val;
+    int str_slice_i = str_slice_fun(ctx, str_i, l, r);
+    *result = (Cell){.ty = ty_str, .val = str_slice_i};
+    return NULL;
+}
+
+static const char *builtin_array_len(Ctx *ctx, const Cell *args, int argc,
+                                     Cell *result) {
+    if (args[0].ty != ty_array) {
+        return "array_len error";
+    }
+
+    int len = array_get(ctx, args[0].val)->len;
+    *result = (Cell){.ty = ty_int, .val = len};
+    return NULL;
+}
+
+static const char *builtin_array_push(Ctx *ctx, const Cell *args, int argc,
+                                      Cell *result) {
+    if (args[0].ty != ty_array) {
+        return "array_push error";
+    }
+
+    array_push(ctx, args[0].val, args[1]);
+    return NULL;
+}
+
+static const char *builtin_array_pop(Ctx *ctx, const Cell *args, int argc,
+                                     Cell *result) {
+    if (args[0].ty != ty_array) {
+        return "array_pop error";
+    }
+
+    array_pop(ctx, args[0].val);
+    return NULL;
+}
+
+static const char *builtin_assert(Ctx *ctx, const Cell *args, int argc,
+                                  Cell *result) {
+    if (args[0].ty != ty_int) {
+        return "assert error";
+    }
+
+    int ok = args[0].val;
+    if (!ok) {
+        return "assertion violated";
+    }
+    return NULL;
+}
+
+static const char *builtin_stdin_to_str(Ctx *ctx, const Cell *args, int argc,
+                                        Cell *result) {
+    int str_i = str_add(ctx, ctx->externals->stdin_to_str());
+    *result = (Cell){.ty = ty_str, .val = str_i};
+    return NULL;
+}
+
+// 組み込み関数の表。すべてのコンテクストで共有する。
+static const ExternFun s_builtins[] = {
+    {"val_type", 1, builtin_val_type},
+    {"str_slice", 3, builtin_str_slice},
+    {"array_len", 1, builtin_array_len},
+    {"array_push", 2, builtin_array_push},
+    {"array_pop", 1, builtin_array_pop},
+    {"assert", 1, builtin_assert},
+    {"stdin_to_str", 0, builtin_stdin_to_str},
+};
+
+static int builtin_len() { return array_len(s_builtins); }
+
+// 組み込み関数を名前で直接呼び出すときに使う、専用の命令を得る。
+// 専用の命令がない関数や、登録簿の関数なら cmd_call_extern を返す。
+static CmdKind builtin_intrinsic_kind(const ExternFun *extern_fun) {
+    extern_fun_t fun = extern_fun->fun;
+    if (fun == builtin_val_type) {
+        return cmd_val_type;
+    }
+    if (fun == builtin_str_slice) {
+        return cmd_str_slice;
+    }
+    if (fun == builtin_array_len) {
+        return cmd_array_len;
+    }
+    if (fun == builtin_array_push) {
+        return cmd_array_push;
+    }
+    if (fun == builtin_array_pop) {
+        return cmd_array_pop;
+    }
+    return cmd_call_extern;
+}
+
+static const ExternFun *builtin_get(int builtin_i) {
+    assert(0 <= builtin_i && builtin_i < builtin_len());
+    return &s_builtins[builtin_i];
+}
+
+// 組み込み関数の名前から要素番号を得る。(なければ -1)
+// 名前解決はコンパイル時に1回ずつしか行わないので、表を先頭から順に探す。
+static int builtin_find(const char *name, int len) {
+    for (int i = 0; i < builtin_len(); i++) {
+        const char *builtin_name = s_builtins[i].name;
+        if ((int)strlen(builtin_name) == len &&
+            memcmp(name, builtin_name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// -----------------------------------------------
+// 外部関数の登録簿
+// -----------------------------------------------
+
+NegiLangRegistry *negi_lang_registry_new() {
+    NegiLangRegistry *registry = mem_alloc(1, sizeof(NegiLangRegistry));
+    *registry = (NegiLangRegistry){};
+    return registry;
+}
+
+void negi_lang_registry_delete(NegiLangRegistry *registry) {
+    if (registry == NULL) {
+        return;
+    }
+
+    // ハッシュテーブルのキーは関数の名前と共有している。
+    for (int i = 0; i < registry->funs.len; i++) {
+        free((void *)registry->funs.data[i].name);
+    }
+    free(registry->funs.data);
+    free(registry->map.data);
+    free(registry);
+}
+
+void negi_lang_registry_add(NegiLangRegistry *registry, const char *name,
+                            int arity, NegiLangExternFun fun) {
+    assert(registry != NULL && name != NULL && fun != NULL);
+
+    int len = strlen(name);
+    int i = str_map_find(&registry->map, name, len);
+    if (i >= 0) {
+        registry->funs.data[i].arity = arity;
+        registry->funs.data[i].fun = fun;
+        return;
+    }
+
+    vec_grow((void **)&registry->funs.data, registry->funs.len,
+             &registry->funs.capacity, sizeof(ExternFun), 1);
+
+    const char *key = string_slice(name, 0, len);
+    i = registry->funs.len++;
+    registry->funs.data[i] = (ExternFun){
+        .name = key,
+        .arity = arity,
+        .fun = fun,
+    };
+    str_map_insert(&registry->map, key, len, i);
+}
+
+// -----------------------------------------------
+// 外部関数に渡す値
+// -----------------------------------------------
+
+// 公開した型タグは内部の型タグと同じ値でなければいけない。
+_Static_assert((int)negi_lang_ty_int == (int)ty_int, "ty_int");
+_Static_assert((int)negi_lang_ty_str == (int)ty_str, "ty_str");
+_Static_assert((int)negi_lang_ty_array == (int)ty_array, "ty_array");
+
+NegiLangCell negi_lang_cell_int(int value) {
+    return (NegiLangCell){.ty = ty_int, .val = value};
+}
+
+NegiLangCell negi_lang_cell_str(Ctx *ctx, const char *str) {
+    assert(ctx != NULL && str != NULL);
+    return (NegiLangCell){.ty = ty_str, .val = str_add(ctx, str)};
+}
+
+const char *negi_lang_cell_str_value(Ctx *ctx, NegiLangCell cell) {
+    assert(ctx != NULL);
+    if (cell.ty != ty_str) {
+        return NULL;
+    }
+    return str_get(ctx, cell.val)->data;
+}
+
+// ###############################################
+// 公開 API
+// ###############################################
+
+Ctx *ctx_new(const char *src) {
+    Ctx *ctx = mem_alloc(1, sizeof(Ctx));
+
+    *ctx = (Ctx){};
+
+    ctx->data = sb_new();
+
+#ifndef NEGI_LANG_NO_PEEPHOLE
+    ctx->peephole_rules = peephole_all;
+#endif
+
+    src_initialize(ctx, src);
+    return ctx;
+}
+
+NegiLangProgram *negi_lang_compile(const char *src,
+                                   const NegiLangRegistry *registry) {
+    return negi_lang_compile_with_options(src, registry, NULL);
+}
+
+NegiLangProgram *
+negi_lang_compile_with_options(const char *src,
+                               const NegiLangRegistry *registry,
+                               const NegiLangCompileOptions *options) {
+    Ctx *ctx = ctx_new(src);
+    ctx->registry = registry;
+    if (options != NULL) {
+        ctx->peephole_rules &= ~options->peephole_disabled;
+    }
+
+    tokenize(ctx);
+    parse(ctx);
+    optimize(ctx);
+    gen(ctx);
+
+    NegiLangProgram *program = mem_alloc(1, sizeof(NegiLangProgram));
+    program->ctx = ctx;
+    return program;
+}
+
+Ctx *negi_lang_context_new(const NegiLangProgram *program) {
+    assert(program != NULL);
+
+    // コンパイル結果は複製せずに共有する。
+    // プログラムのコンテクストは評価に使われないので、評価の状態は空になっている。
+    Ctx *ctx = mem_alloc(1, sizeof(Ctx));
+    *ctx = *program->ctx;
+
+    // コンパイルエラーの後ろに実行時エラーを追加するので、エラーリストは複製する。
+    int err_len = ctx->errs.len;
+    ctx->errs = (Errs){};
+    mem_reserve((void **)&ctx->errs.data, 0, sizeof(Err), &ctx->errs.capacity,
+                err_len);
+    if (err_len > 0) {
+        memcpy(ctx->errs.data, program->ctx->errs.data, err_len * sizeof(Err));
+    }
+    ctx->errs.len = err_len;
+    ctx->err_len_compile = err_len;
+
+    // 実行中に命令を書き換えるので、命令リストは複製する。
+    int cmd_len = ctx->cmds.len;
+    ctx->cmds = (VecCmd){};
+    mem_reserve((void **)&ctx->cmds.data, 0, sizeof(Cmd), &ctx->cmds.capacity,
+                cmd_len);
+    memcpy(ctx->cmds.data, program->ctx->cmds.data, cmd_len * sizeof(Cmd));
+    ctx->cmds.len = cmd_len;
+
+    return ctx;
+}
+
+int negi_lang_run(Ctx *ctx, NegiLangExternals *externals) {
+    ctx->externals = externals;
+
+    eval(ctx);
+
+    if (externals->exit_code != NULL) {
+        *externals->exit_code = ctx->exit_code;
+    }
+    if (externals->output != NULL) {
+        *externals->output = err_summary(ctx);
+    }
+
+    ctx->externals = NULL;
+    return ctx->exit_code;
+}
+
+void negi_lang_context_delete(Ctx *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < ctx->strs.len; i++) {
+        free(ctx->strs.data[i].data);
+    }
+    array_free_all(ctx);
+
+    free(ctx->errs.data);
+    free(ctx->cmds.data);
+    free(ctx->code);
+    free(ctx->cells.data);
+    free(ctx->frames.data);
+    free(ctx->strs.data);
+    free(ctx->arrays.data);
+    free(ctx->envs.data);
+    free(ctx->closures.data);
+    free(ctx->gc_cell_map.data);
+    free(ctx->gc_str_map.data);
+    free(ctx->gc_array_map.data);
+    free(ctx->gc_env_map.data);
+    free(ctx->gc_closure_map.data);
+    free(ctx->gc_stack.data);
+    free(ctx);
+}
+
+void negi_lang_program_delete(NegiLangProgram *program) {
+    if (program == NULL) {
+        return;
+    }
+
+    // コンパイル結果はプログラムのコンテクストだけが所有している。
+    // 評価の状態はコンテクストと同様に破棄する。
+    Ctx *ctx = program->ctx;
+    free((void *)ctx->src);
+    if (ctx->data->capacity > 0) {
+        free(ctx->data->data);
+    }
+    free(ctx->data);
+    free(ctx->consts.data);
+    for (int i = 0; i < ctx->const_map.capacity; i++) {
+        free((void *)ctx->const_map.data[i].key);
+    }
+    free(ctx->const_map.data);
+    free(ctx->toks.data);
+    for (int i = 0; i < ctx->syms.len; i++) {
+        free((void *)ctx->syms.data[i].text);
+    }
+    free(ctx->syms.data);
+    free(ctx->sym_map.data);
+    free(ctx->subexps.data);
+    free(ctx->exps.data);
+    for (int i = 0; i < ctx->opt_str_len; i++) {
+        free(ctx->opt_strs[i]);
+    }
+    free(ctx->opt_strs);
+    free(ctx->labels.data);
+    free(ctx->scopes.data);
+    free(ctx->locals.data);
+    free(ctx->bindings.data);
+    for (int i = 0; i < ctx->funs.len; i++) {
+        free((void *)ctx->funs.data[i].name);
+    }
+    free(ctx->funs.data);
+    free(ctx->upvals.data);
+    free(ctx->upvals_gen.data);
+    free(ctx->loops.data);
+
+    negi_lang_context_delete(ctx);
+    free(program);
+}
+
+// ###############################################
+// バイトコードのイメージ
+// ###############################################
+
+// コンパイル結果のうち、評価に必要なものだけをバイト列に書き出す。
+// 整数は 4 バイトずつ実行環境のバイト順で並べ、末尾にチェックサムを置く。
+// 形式:
+//  マジックナンバー, バージョン
+//  ソースコード (エラーメッセージ用)
+//  トークンの位置のリスト, コンパイルエラーのリスト
+//  データ領域, 定数リスト, スコープリスト, 関数リスト
+//  外部関数の名前のリスト, 命令リスト
+//  その他の番号, チェックサム
+
+// -----------------------------------------------
+// イメージ: 書き込み
+// -----------------------------------------------
+
+static void image_write_int(ImageWriter *w, int value) {
+    vec_grow((void **)&w->data, w->len, &w->capacity, 1, sizeof(int));
+    memcpy(w->data + w->len, &value, sizeof(int));
+    w->len += sizeof(int);
+}
+
+// 長さとバイト列を書き込む。
+static void image_write_bytes(ImageWriter *w, const char *data, int len) {
+    image_write_int(w, len);
+    if (len > 0) {
+        vec_grow((void **)&w->data, w->len, &w->capacity, 1, len);
+        memcpy(w->data + w->len, data, len);
+        w->len += len;
+    }
+}
+
+static void image_write_str(ImageWriter *w, const char *str) {
+    image_write_bytes(w, str, str == NULL ? 0 : strlen(str));
+}
+
+// -----------------------------------------------
+// イメージ: 読み込み
+// -----------------------------------------------
+
+static int image_read_int(ImageReader *r) {
+    if (r->err || r->len - r->pos < (int)sizeof(int)) {
+        r->err = true;
+        return 0;
+    }
+
+    int value;
+    memcpy(&value, r->data + r->pos, sizeof(int));
+    r->pos += sizeof(int);
+    return value;
+}
+
+// [0, len) の範囲の番号を読み込む。
+static int image_read_index(ImageReader *r, int len) {
+    int value = image_read_int(r);
+    if (value < 0 || value >= len) {
+        r->err = true;
+        return 0;
+    }
+    return value;
+}
+
+// 要素の個数を読み込む。各要素は少なくとも unit バイトを占める。
+static int image_read_count(ImageReader *r, int unit) {
+    int count = image_read_int(r);
+    if (count < 0 || count > (r->len - r->pos) / unit) {
+        r->err = true;
+        return 0;
+    }
+    return count;
+}
+
+// 長さとバイト列を読み込んで、ゼロ終端の文字列として複製する。
+// 失敗しても、解放できる空の文字列を返す。
+static char *image_read_str(ImageReader *r, int *len) {
+    int n = image_read_count(r, 1);
+    if (r->err) {
+        *len = 0;
+        return mem_alloc(1, sizeof(char));
+    }
+
+    char *str = mem_alloc(n + 1, sizeof(char));
+    memcpy(str, r->data + r->pos, n);
+    str[n] = '\0';
+    r->pos += n;
+
+    *len = n;
+    return str;
+}
+
+// -----------------------------------------------
+// イメージ: 命令の検査
+// -----------------------------------------------
+
+// 関数 fun_i の実行中に、var_kind の index 番目の変数を参照できるか。
+static bool image_var_is_valid(Ctx *ctx, int fun_i, int var_kind, int index) {
+    const Fun *fun = &ctx->funs.data[fun_i];
+    if (index < 0) {
+        return false;
+    }
+
+    switch (var_kind) {
+    case var_local:
+        return index < ctx->scopes.data[fun->scope_i].len;
+    case var_upval:
+        return index < fun->upval_len;
+    case var_global:
+        return index < ctx->scopes.data[ctx->scope_i_global].len;
+    default:
+        return false;
+    }
+}
+
+// 関数 fun_i の実行中に、関数 sub_fun_i のクロージャを生成できるか。
+// 捕獲変数は生成する側の関数から見た位置で指定されている。
+static bool image_upvals_are_valid(Ctx *ctx, int fun_i, int sub_fun_i) {
+    const Fun *fun = &ctx->funs.data[fun_i];
+    const Fun *sub_fun = &ctx->funs.data[sub_fun_i];
+
+    // ローカル変数をスタック領域に置く関数は、ローカル変数を捕獲させられない。
+    bool has_env = fun_i == ctx->fun_i_main || !fun->stack_locals;
+
+    for (int i = 0; i < sub_fun->upval_len; i++) {
+        const Upval *upval = &ctx->upvals.data[sub_fun->upval_l + i];
+        if (upval->from_local && !has_env) {
+            return false;
+        }
+
+        int var_kind = upval->from_local ? var_local : var_upval;
+        if (!image_var_is_valid(ctx, fun_i, var_kind, upval->index)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 読み込んだ命令が評価中に範囲外の要素を参照しないか検査する。
+// fun_i: 命令を実行する関数
+static bool image_cmd_is_valid(Ctx *ctx, const Cmd *cmd, int fun_i) {
+    if (cmd->tok_i < 0 || cmd->tok_i >= ctx->toks.len) {
+        return false;
+    }
+
+    switch (cmd->kind) {
+    case cmd_exit:
+    case cmd_push_int:
+    case cmd_cell_get:
+    case cmd_cell_set:
+    case cmd_cell_set_pop:
+    case cmd_pop:
+    case cmd_swap:
+    case cmd_dup:
+    case cmd_return:
+    case cmd_val_type:
+    case cmd_str_slice:
+    case cmd_array_len:
+    case cmd_array_push:
+    case cmd_array_pop:
+        return true;
+    case cmd_err:
+    case cmd_push_str:
+        return 0 <= cmd->x && cmd->x < ctx->consts.len;
+    case cmd_jump:
+    case cmd_jump_unless:
+    case cmd_jump_if:
+    case cmd_jump_if_eq:
+    case cmd_jump_if_ne:
+    case cmd_jump_if_lt:
+    case cmd_jump_if_le:
+    case cmd_jump_if_gt:
+    case cmd_jump_if_ge:
+        return 0 <= cmd->x && cmd->x < ctx->cmds.len;
+    case cmd_push_extern:
+        return 0 <= cmd->x && cmd->x < extern_fun_len(ctx);
+    case cmd_push_closure:
+        return 0 <= cmd->x && cmd->x < ctx->funs.len &&
+               ctx->funs.data[cmd->x].kind == fun_kind_closure &&
+               image_upvals_are_valid(ctx, fun_i, cmd->x);
+    case cmd_push_array:
+    case cmd_call:
+    case cmd_tail_call:
+        return 0 <= cmd->x && cmd->x < stack_len_min;
+    case cmd_local_ref:
+    case cmd_load_local:
+    case cmd_store_local:
+    case cmd_store_local_pop:
+    case cmd_inc_local:
+        return image_var_is_valid(ctx, fun_i, cmd->y, cmd->x);
+    case cmd_load_global:
+    case cmd_store_global:
+    case cmd_store_global_pop:
+        return image_var_is_valid(ctx, fun_i, var_global, cmd->x);
+    case cmd_call_extern:
+        return 0 <= cmd->x && cmd->x < stack_len_min && 0 <= cmd->y &&
+               cmd->y < extern_fun_len(ctx);
+    case cmd_op:
+        // 代入や論理演算は、演算の命令ではなくジャンプなどに変換されている。
+        return (op_eq <= cmd->x && cmd->x <= op_index) ||
+               cmd->x == op_index_ref || cmd->x == op_array_push;
+    case cmd_index_set:
+    case cmd_index_set_pop:
+        return cmd->x == op_set || (op_add <= cmd->x && cmd->x <= op_mod);
+    default:
+        // ラベルはリンク時に取り除かれている。
+        return false;
+    }
+}
+
+// 命令を実行するときにスタックから下ろす値の個数と、積む値の個数を求める。
+// 実行がその命令から先に進まない命令については、下ろす個数だけを求める。
+static void image_cmd_stack_effect(const Cmd *cmd, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+
+    switch (cmd->kind) {
+    case cmd_push_int:
+    case cmd_push_str:
+    case cmd_push_array:
+    case cmd_push_closure:
+    case cmd_push_extern:
+    case cmd_local_ref:
+    case cmd_load_local:
+    case cmd_load_global:
+        *pushes = 1;
+        return;
+    case cmd_exit:
+    case cmd_return:
+    case cmd_jump_unless:
+    case cmd_jump_if:
+    case cmd_store_local_pop:
+    case cmd_store_global_pop:
+    case cmd_pop:
+        *pops = 1;
+        return;
+    case cmd_store_local:
+    case cmd_store_global:
+    case cmd_inc_local:
+    case cmd_cell_get:
+    case cmd_val_type:
+    case cmd_array_len:
+    case cmd_array_pop:
+        *pops = 1;
+        *pushes = 1;
+        return;
+    case cmd_jump_if_eq:
+    case cmd_jump_if_ne:
+    case cmd_jump_if_lt:
+    case cmd_jump_if_le:
+    case cmd_jump_if_gt:
+    case cmd_jump_if_ge:
+    case cmd_cell_set_pop:
+        *pops = 2;
+        return;
+    case cmd_cell_set:
+    case cmd_array_push:
+    case cmd_op:
+        *pops = 2;
+        *pushes = 1;
+        return;
+    case cmd_swap:
+        *pops = 2;
+        *pushes = 2;
+        return;
+    case cmd_dup:
+        *pops = 1;
+        *pushes = 2;
+        return;
+    case cmd_index_set:
+    case cmd_str_slice:
+        *pops = 3;
+        *pushes = 1;
+        return;
+    case cmd_index_set_pop:
+        *pops = 3;
+        return;
+    case cmd_call:
+        // 関数の値と引数を下ろして、戻り値を積む。
+        *pops = cmd->x + 1;
+        *pushes = 1;
+        return;
+    case cmd_tail_call:
+        *pops = cmd->x + 1;
+        return;
+    case cmd_call_extern:
+        *pops = cmd->x;
+        *pushes = 1;
+        return;
+    default:
+        return;
+    }
+}
+
+// 命令 cmd_i を関数 fun_i が、フレーム内のスタックの深さ depth で実行するものとして記録する。
+// 初めて到達したか、より浅い深さで到達したなら、検査するために stack に積む。
+// 命令リストの外か、別の関数が実行する命令なら false を返す。
+static bool image_cmd_visit(ImageFlow *flow, int cmd_i, int fun_i, int depth) {
+    if (cmd_i < 0 || cmd_i >= flow->cmd_len) {
+        return false;
+    }
+    if (flow->funs[cmd_i] >= 0) {
+        if (flow->funs[cmd_i] != fun_i) {
+            return false;
+        }
+        if (flow->depths[cmd_i] <= depth) {
+            return true;
+        }
+    }
+
+    flow->funs[cmd_i] = fun_i;
+    flow->depths[cmd_i] = depth;
+    vec_int_push(&flow->stack, cmd_i);
+    return true;
+}
+
+// 各関数の入り口から実行が進みうる命令を辿り、それぞれの命令を実行する関数を決めて検査する。
+// 変数の位置は関数ごとに意味が異なるので、複数の関数から実行される命令は認めない。
+// また、命令がフレームの開始時より下にあるスタックの値を下ろさないことを確かめる。
+// スタックの深さは合流する経路のうち最も浅いもので見積もる。
+// 到達しない命令は実行されないので検査しない。
+static bool image_cmds_are_valid(Ctx *ctx) {
+    // トップレベルはグローバル環境で実行され、捕獲変数を持たない。
+    const Fun *main = &ctx->funs.data[ctx->fun_i_main];
+    if (main->kind != fun_kind_closure ||
+        main->scope_i != ctx->scope_i_global || main->upval_len != 0) {
+        return false;
+    }
+
+    int cmd_len = ctx->cmds.len;
+    ImageFlow flow = (ImageFlow){
+        .cmd_len = cmd_len,
+        .funs = mem_alloc(cmd_len, sizeof(int)),
+        .depths = mem_alloc(cmd_len, sizeof(int)),
+    };
+    for (int i = 0; i < cmd_len; i++) {
+        flow.funs[i] = -1;
+    }
+
+    bool ok = image_cmd_visit(&flow, ctx->cmd_i_entry, ctx->fun_i_main, 0);
+    for (int fun_i = 0; ok && fun_i < ctx->funs.len; fun_i++) {
+        const Fun *fun = &ctx->funs.data[fun_i];
+        if (fun->kind != fun_kind_closure) {
+            continue;
+        }
+
+        // ローカル変数をスタック領域に置く関数は、それらを積んだ状態で始まる。
+        int depth = 0;
+        if (fun_i != ctx->fun_i_main && fun->stack_locals) {
+            depth = ctx->scopes.data[fun->scope_i].len;
+        }
+        ok = image_cmd_visit(&flow, fun->cmd_i, fun_i, depth);
+    }
+
+    while (ok && flow.stack.len > 0) {
+        int cmd_i = flow.stack.data[--flow.stack.len];
+        int fun_i = flow.funs[cmd_i];
+        int depth = flow.depths[cmd_i];
+        const Cmd *cmd = &ctx->cmds.data[cmd_i];
+        if (!image_cmd_is_valid(ctx, cmd, fun_i)) {
+            ok = false;
+            break;
+        }
+
+        int pops, pushes;
+        image_cmd_stack_effect(cmd, &pops, &pushes);
+        if (depth < pops) {
+            ok = false;
+            break;
+        }
+        depth += pushes - pops;
+
+        switch (cmd->kind) {
+        case cmd_err:
+        case cmd_exit:
+        case cmd_return:
+        case cmd_tail_call:
+            // エラーの命令は必ず実行を中断する。
+            break;
+        case cmd_jump:
+            ok = image_cmd_visit(&flow, cmd->x, fun_i, depth);
+            break;
+        case cmd_jump_unless:
+        case cmd_jump_if:
+        case cmd_jump_if_eq:
+        case cmd_jump_if_ne:
+        case cmd_jump_if_lt:
+        case cmd_jump_if_le:
+        case cmd_jump_if_gt:
+        case cmd_jump_if_ge:
+            ok = image_cmd_visit(&flow, cmd->x, fun_i, depth) &&
+                 image_cmd_visit(&flow, cmd_i + 1, fun_i, depth);
+            break;
+        default:
+            // 関数呼び出しからは次の命令に戻ってくる。
+            ok = image_cmd_visit(&flow, cmd_i + 1, fun_i, depth);
+            break;
+        }
+    }
 
-    // HELP: optimize
-    Cell first = stack_pop(ctx);
-    stack_push(ctx, first);
-    stack_push(ctx, first);
+    free(flow.funs);
+    free(flow.depths);
+    free(flow.stack.data);
+    return ok;
 }
 
-static void eval_call(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_call);
-    int len = cmd->x;
-
-    Cell args[32];
-    if (len >= array_len(args)) {
-        unimplemented();
-    }
-    for (int i = len - 1; i >= 0; i--) {
-        args[i] = stack_pop(ctx);
-    }
-    Cell fun = stack_pop(ctx);
+// -----------------------------------------------
+// イメージ: 保存と復元
+// -----------------------------------------------
 
-    if (fun.ty == ty_closure) {
-        int closure_i = fun.val;
-        Closure *closure = closure_get(ctx, closure_i);
-        assert(fun_get(ctx, closure->fun_i)->kind == fun_kind_closure);
+void *negi_lang_program_save(const NegiLangProgram *program, int *size) {
+    const Ctx *ctx = program->ctx;
+    ImageWriter w = (ImageWriter){};
 
-        int body_cmd_i = fun_get(ctx, closure->fun_i)->cmd_i;
+    image_write_int(&w, image_magic);
+    image_write_int(&w, image_version);
 
-        // ローカル環境を生成する。
-        int env_i = env_add(ctx, closure->env_i, closure->fun_i);
+    image_write_bytes(&w, ctx->src, ctx->src_len);
 
-        Env *env = env_get(ctx, env_i);
-        for (int i = 0; i < len; i++) {
-            array_set_item(ctx, env->array_i, i, args[i]);
-        }
+    image_write_int(&w, ctx->toks.len);
+    for (int i = 0; i < ctx->toks.len; i++) {
+        image_write_int(&w, ctx->toks.data[i].src_l);
+        image_write_int(&w, ctx->toks.data[i].src_r);
+    }
 
-        frame_push(ctx, ctx->pc, env_i, cmd->tok_i);
-        ctx->pc = body_cmd_i;
-        return;
+    image_write_int(&w, ctx->errs.len);
+    for (int i = 0; i < ctx->errs.len; i++) {
+        image_write_str(&w, ctx->errs.data[i].message);
+        image_write_int(&w, ctx->errs.data[i].src_l);
+        image_write_int(&w, ctx->errs.data[i].src_r);
     }
 
-    if (fun.ty == ty_extern) {
-        int extern_fun_i = fun.val;
+    image_write_bytes(&w, ctx->data->data, ctx->data->size);
 
-        int array_i = array_add(ctx, len, len);
+    image_write_int(&w, ctx->consts.len);
+    for (int i = 0; i < ctx->consts.len; i++) {
+        image_write_int(&w, ctx->consts.data[i].offset);
+        image_write_int(&w, ctx->consts.data[i].len);
+    }
 
-        CellIndexPair result_cell_range = heap_alloc(ctx, 1);
-        int result_cell_i = result_cell_range.cell_l;
+    image_write_int(&w, ctx->scopes.len);
+    for (int i = 0; i < ctx->scopes.len; i++) {
+        image_write_int(&w, ctx->scopes.data[i].parent);
+        image_write_int(&w, ctx->scopes.data[i].len);
+        image_write_int(&w, ctx->scopes.data[i].tok_i);
+    }
 
-        for (int i = 0; i < len; i++) {
-            array_set_item(ctx, array_i, i, args[i]);
-        }
+    image_write_int(&w, ctx->funs.len);
+    for (int i = 0; i < ctx->funs.len; i++) {
+        const Fun *fun = &ctx->funs.data[i];
+        image_write_int(&w, fun->kind);
+        image_write_str(&w, fun->name);
+        image_write_int(&w, fun->scope_i);
+        image_write_int(&w, fun->cmd_i);
+        image_write_int(&w, fun->stack_locals);
+        image_write_int(&w, fun->upval_l);
+        image_write_int(&w, fun->upval_len);
+    }
 
-        extern_frame_activate(ctx, array_i, result_cell_i);
-        extern_fun_get(ctx, extern_fun_i)->fun(ctx, len);
+    image_write_int(&w, ctx->upvals.len);
+    for (int i = 0; i < ctx->upvals.len; i++) {
+        image_write_int(&w, ctx->upvals.data[i].from_local);
+        image_write_int(&w, ctx->upvals.data[i].index);
+    }
 
-        if (ctx->extern_frame.err) {
-            eval_abort(ctx, ctx->extern_frame.err_message, cmd->tok_i);
-        } else {
-            stack_push(ctx, *cell_get(ctx, result_cell_i));
-        }
+    // 外部関数は名前で束縛し直す。
+    int extern_len = extern_fun_len((Ctx *)ctx);
+    image_write_int(&w, extern_len);
+    for (int i = 0; i < extern_len; i++) {
+        image_write_str(&w, extern_fun_get((Ctx *)ctx, i)->name);
+    }
 
-        extern_frame_deactivate(ctx);
-        return;
+    image_write_int(&w, ctx->cmds.len);
+    for (int i = 0; i < ctx->cmds.len; i++) {
+        const Cmd *cmd = &ctx->cmds.data[i];
+        image_write_int(&w, cmd->kind);
+        image_write_int(&w, cmd->x);
+        image_write_int(&w, cmd->y);
+        image_write_int(&w, cmd->tok_i);
     }
 
-    eval_abort(ctx, "型エラー", cmd->tok_i);
-}
+    image_write_int(&w, ctx->tok_i_eof);
+    image_write_int(&w, ctx->scope_i_global);
+    image_write_int(&w, ctx->fun_i_main);
+    image_write_int(&w, ctx->cmd_i_entry);
+    image_write_int(&w, ctx->cmd_i_exit);
 
-static void eval_return(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_return);
+    image_write_int(&w, (int)string_hash(w.data, w.len));
 
-    ctx->pc = frame_pop(ctx)->cmd_i;
+    *size = w.len;
+    return w.data;
 }
 
-static void eval_op(Ctx *ctx, int cmd_i) {
-    defcmd;
-    assert(cmd->kind == cmd_op);
-    OpKind op = (OpKind)cmd->x;
-
-    assert(op != op_semi);
-    assert(op != op_ne);
-    assert(op != op_le);
-    assert(op != op_gt);
-    assert(op != op_ge);
-
-    Cell r_cell = stack_pop(ctx);
-    Cell l_cell = stack_pop(ctx);
-    int ty = l_cell.ty;
-    int val = l_cell.val;
+NegiLangProgram *negi_lang_program_load(const void *image, int size,
+                                        const NegiLangRegistry *registry) {
+    ImageReader reader = (ImageReader){.data = image, .len = size};
+    ImageReader *r = &reader;
 
-    if (op == op_eq) {
-        if (ty != r_cell.ty) {
-            stack_push(ctx, s_cell_null);
-            return;
-        }
-        if (ty == ty_int) {
-            stack_push(ctx, cell_from_bool(val == r_cell.val));
-            return;
-        }
-        if (ty == ty_str) {
-            bool cmp =
-                strcmp(str_get(ctx, val)->data, str_get(ctx, r_cell.val)->data);
-            stack_push(ctx, cell_from_bool(cmp == 0));
-            return;
-        }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+    // チェックサムを確かめてから中身を読む。
+    int body_len = size - (int)sizeof(int);
+    if (image == NULL || body_len < 0) {
+        return NULL;
+    }
+    int hash;
+    memcpy(&hash, r->data + body_len, sizeof(int));
+    if (hash != (int)string_hash(r->data, body_len)) {
+        return NULL;
     }
+    r->len = body_len;
 
-    if (op == op_lt) {
-        if (ty != r_cell.ty) {
-            stack_push(ctx, cell_from_bool(ty < r_cell.ty));
-            return;
-        }
-        if (ty == ty_int) {
-            stack_push(ctx, cell_from_bool(val < r_cell.val));
-            return;
-        }
-        if (ty == ty_str) {
-            int cmp =
-                strcmp(str_get(ctx, val)->data, str_get(ctx, r_cell.val)->data);
-            stack_push(ctx, cell_from_bool(cmp < 0));
-            return;
-        }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+    if (image_read_int(r) != image_magic ||
+        image_read_int(r) != image_version) {
+        return NULL;
     }
 
-    if (op == op_index) {
-        if (ty == ty_str && r_cell.ty == ty_int) {
-            int i = r_cell.val;
-            const Str *str = str_get(ctx, val);
-            char c = 0 <= i && i < str->len ? str->data[i] : '\0';
-            stack_push(ctx, (Cell){.ty = ty_int, .val = (int)c});
-            return;
-        }
-        if (ty == ty_array && r_cell.ty == ty_int) {
-            Cell item = array_get_item(ctx, val, r_cell.val);
-            stack_push(ctx, item);
-            return;
-        }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+    // 失敗したら、読み込みかけのプログラムごと破棄する。
+    NegiLangProgram *program = mem_alloc(1, sizeof(NegiLangProgram));
+    Ctx *ctx = ctx_new("");
+    ctx->registry = registry;
+    program->ctx = ctx;
+    free((void *)ctx->src);
+
+    ctx->src = image_read_str(r, &ctx->src_len);
+
+    int tok_len = image_read_count(r, 2 * sizeof(int));
+    mem_reserve((void **)&ctx->toks.data, 0, sizeof(Tok), &ctx->toks.capacity,
+                tok_len);
+    for (int i = 0; i < tok_len; i++) {
+        int src_l = image_read_index(r, ctx->src_len + 1);
+        int src_r = image_read_index(r, ctx->src_len + 1);
+        r->err = r->err || src_l > src_r;
+        ctx->toks.data[i] = (Tok){
+            .kind = tok_err,
+            .src_l = src_l,
+            .src_r = src_r,
+            .sym_i = -1,
+        };
     }
-    if (op == op_index_ref) {
-        if (ty == ty_array && r_cell.ty == ty_int) {
-            int cell_i = array_ref(ctx, val, r_cell.val);
-            stack_push(ctx, (Cell){.ty = ty_cell, .val = cell_i});
-            return;
-        }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
+    ctx->toks.len = tok_len;
+
+    int err_len = image_read_count(r, 3 * sizeof(int));
+    mem_reserve((void **)&ctx->errs.data, 0, sizeof(Err), &ctx->errs.capacity,
+                err_len);
+    for (int i = 0; i < err_len; i++) {
+        int message_len;
+        const char *message = image_read_str(r, &message_len);
+        int src_l = image_read_index(r, ctx->src_len + 1);
+        int src_r = image_read_index(r, ctx->src_len + 1);
+        r->err = r->err || src_l > src_r;
+        ctx->errs.data[i] =
+            (Err){.message = message, .src_l = src_l, .src_r = src_r};
     }
-    if (op == op_array_push) {
-        assert(ty == ty_array);
-        array_push(ctx, val, r_cell);
-        stack_push(ctx, l_cell);
-        return;
+    ctx->errs.len = err_len;
+
+    // データ領域が空なら、生成時の空の文字列のままにしておく。
+    int data_len;
+    char *data = image_read_str(r, &data_len);
+    if (data_len > 0) {
+        ctx->data->data = data;
+        ctx->data->size = data_len;
+        ctx->data->capacity = data_len;
+    } else {
+        free(data);
     }
 
-    if (ty != r_cell.ty) {
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+    int const_len = image_read_count(r, 2 * sizeof(int));
+    mem_reserve((void **)&ctx->consts.data, 0, sizeof(Const),
+                &ctx->consts.capacity, const_len);
+    for (int i = 0; i < const_len; i++) {
+        int offset = image_read_index(r, data_len + 1);
+        int len = image_read_index(r, data_len - offset + 1);
+        ctx->consts.data[i] = (Const){.offset = offset, .len = len};
     }
-
-    if (op == op_add) {
-        if (ty == ty_int) {
-            stack_push(ctx, (Cell){.ty = ty_int, .val = val + r_cell.val});
-            return;
-        }
-        if (ty == ty_str) {
-            StringBuilder *sb = sb_new();
-            sb_append(sb, str_get(ctx, val)->data);
-            sb_append(sb, str_get(ctx, r_cell.val)->data);
-            int str_i = str_add(ctx, sb_to_str(sb));
-            stack_push(ctx, (Cell){.ty = ty_str, .val = str_i});
-            return;
-        }
-        eval_abort(ctx, "演算子 + をサポートしていません。", cmd->tok_i);
-        return;
+    ctx->consts.len = const_len;
+
+    int scope_len = image_read_count(r, 3 * sizeof(int));
+    mem_reserve((void **)&ctx->scopes.data, 0, sizeof(Scope),
+                &ctx->scopes.capacity, scope_len);
+    for (int i = 0; i < scope_len; i++) {
+        int parent = image_read_int(r);
+        int len = image_read_int(r);
+        int tok_i = image_read_index(r, tok_len);
+        r->err = r->err || parent < -1 || parent >= scope_len || len < 0;
+        ctx->scopes.data[i] =
+            (Scope){.parent = parent, .len = len, .tok_i = tok_i};
     }
-
-    if (op == op_sub) {
-        if (ty == ty_int) {
-            stack_push(ctx, (Cell){.ty = ty_int, .val = val - r_cell.val});
-            return;
+    ctx->scopes.len = scope_len;
+
+    // 命令リストはまだ読んでいないので、関数の命令番号は後で検査する。
+    int fun_len = image_read_count(r, 7 * sizeof(int));
+    mem_reserve((void **)&ctx->funs.data, 0, sizeof(Fun), &ctx->funs.capacity,
+                fun_len);
+    for (int i = 0; i < fun_len; i++) {
+        int kind = image_read_int(r);
+        int name_len;
+        const char *name = image_read_str(r, &name_len);
+        int scope_i = image_read_int(r);
+        int cmd_i = image_read_int(r);
+        int stack_locals = image_read_int(r);
+        int upval_l = image_read_int(r);
+        int upval_len = image_read_int(r);
+        r->err = r->err || (kind != fun_kind_closure && kind != fun_kind_extern);
+        if (kind == fun_kind_closure) {
+            r->err = r->err || scope_i < 0 || scope_i >= scope_len;
         }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+        ctx->funs.data[i] = (Fun){
+            .kind = kind,
+            .name = name,
+            .scope_i = scope_i,
+            .label_i = -1,
+            .cmd_i = cmd_i,
+            .stack_locals = stack_locals != 0,
+            .upval_l = upval_l,
+            .upval_len = upval_len,
+        };
     }
-    if (op == op_mul) {
-        if (ty == ty_int) {
-            stack_push(ctx, (Cell){.ty = ty_int, .val = val * r_cell.val});
-            return;
-        }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
+    ctx->funs.len = fun_len;
+
+    int upval_len = image_read_count(r, 2 * sizeof(int));
+    mem_reserve((void **)&ctx->upvals.data, 0, sizeof(Upval),
+                &ctx->upvals.capacity, upval_len);
+    for (int i = 0; i < upval_len; i++) {
+        int from_local = image_read_int(r);
+        int index = image_read_int(r);
+        r->err = r->err || index < 0;
+        ctx->upvals.data[i] = (Upval){
+            .scope_i = -1,
+            .local_i = -1,
+            .from_local = from_local != 0,
+            .index = index,
+        };
     }
-    if (op == op_div) {
-        if (ty == ty_int) {
-            stack_push(ctx, (Cell){.ty = ty_int, .val = val / r_cell.val});
-            return;
+    ctx->upvals.len = upval_len;
+
+    for (int i = 0; i < fun_len; i++) {
+        const Fun *fun = &ctx->funs.data[i];
+        if (fun->upval_l < 0 || fun->upval_len < 0 ||
+            fun->upval_l > upval_len - fun->upval_len) {
+            r->err = true;
         }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
     }
-    if (op == op_mod) {
-        if (ty == ty_int) {
-            stack_push(ctx, (Cell){.ty = ty_int, .val = val % r_cell.val});
-            return;
+
+    // イメージ上の外部関数番号を、このコンテクストの外部関数番号に対応させる。
+    // 見つからない外部関数は -1 にしておき、命令が参照していたら失敗とする。
+    int extern_len = image_read_count(r, sizeof(int));
+    int *extern_map = mem_alloc(extern_len + 1, sizeof(int));
+    for (int i = 0; i < extern_len; i++) {
+        int name_len;
+        const char *name = image_read_str(r, &name_len);
+        if (r->err || !extern_fun_find(ctx, name, &extern_map[i])) {
+            extern_map[i] = -1;
         }
-        eval_abort(ctx, "型エラー", cmd->tok_i);
-        return;
     }
 
-    failwith("Unknown OpKind");
-}
-
-static void eval_cmds(Ctx *ctx) {
-    while (true) {
-        int cmd_i = ctx->pc++;
-        switch ((CmdKind)cmd_get(ctx, cmd_i)->kind) {
-        case cmd_push_int:
-            eval_push_int(ctx, cmd_i);
-            continue;
-        case cmd_push_str:
-            eval_push_str(ctx, cmd_i);
-            continue;
-        case cmd_push_array:
-            eval_push_array(ctx, cmd_i);
-            continue;
-        case cmd_push_closure:
-            eval_push_closure(ctx, cmd_i);
-            continue;
-        case cmd_push_extern:
-            eval_push_extern(ctx, cmd_i);
-            continue;
-        case cmd_push_env:
-            eval_push_env(ctx, cmd_i);
-            continue;
-        case cmd_local_var:
-            eval_local_var(ctx, cmd_i);
-            continue;
-        case cmd_cell_get:
-            eval_cell_get(ctx, cmd_i);
-            continue;
-        case cmd_cell_set:
-            eval_cell_set(ctx, cmd_i);
-            continue;
-        case cmd_label:
-            eval_label(ctx, cmd_i);
-            continue;
-        case cmd_jump_unless:
-            eval_jump_unless(ctx, cmd_i);
-            continue;
-        case cmd_pop:
-            eval_pop(ctx, cmd_i);
-            continue;
-        case cmd_swap:
-            eval_swap(ctx, cmd_i);
-            continue;
-        case cmd_dup:
-            eval_dup(ctx, cmd_i);
-            continue;
-        case cmd_call:
-            eval_call(ctx, cmd_i);
-            continue;
-        case cmd_return:
-            eval_return(ctx, cmd_i);
-            continue;
-        case cmd_op:
-            eval_op(ctx, cmd_i);
-            continue;
-        case cmd_err:
-            eval_err(ctx, cmd_i);
-            continue;
-        case cmd_exit: {
-            Cell cell = stack_pop(ctx);
-            if (cell.ty != ty_int) {
-                eval_abort(ctx, "終了コードは整数値でなければいけません。",
-                           eval_current_tok_i(ctx));
-                continue;
-            }
-            ctx->exit_code = cell.val;
-            return;
+    int cmd_len = image_read_count(r, 4 * sizeof(int));
+    mem_reserve((void **)&ctx->cmds.data, 0, sizeof(Cmd), &ctx->cmds.capacity,
+                cmd_len);
+    ctx->cmds.len = cmd_len;
+    for (int i = 0; i < cmd_len; i++) {
+        Cmd *cmd = &ctx->cmds.data[i];
+        cmd->kind = image_read_int(r);
+        cmd->x = image_read_int(r);
+        cmd->y = image_read_int(r);
+        cmd->tok_i = image_read_int(r);
+
+        if (!r->err && cmd->kind == cmd_push_extern) {
+            r->err = cmd->x < 0 || cmd->x >= extern_len ||
+                     extern_map[cmd->x] < 0;
+            cmd->x = r->err ? 0 : extern_map[cmd->x];
         }
-        default:
-            failwith("Unknown CmdKind");
+        if (!r->err && cmd->kind == cmd_call_extern) {
+            r->err = cmd->y < 0 || cmd->y >= extern_len ||
+                     extern_map[cmd->y] < 0;
+            cmd->y = r->err ? 0 : extern_map[cmd->y];
+
+            // 束縛し直した外部関数の引数の個数が合うことを確かめる。
+            int arity = extern_fun_get(ctx, cmd->y)->arity;
+            r->err = r->err || (arity >= 0 && cmd->x != arity);
         }
     }
-}
-
-static void eval(Ctx *ctx) {
-    ctx->pc = ctx->cmd_i_entry;
-    ctx->does_gc = false;
-    ctx->exit_code = 1;
-
-    cell_initialize(ctx);
-
-    // グローバル環境を生成する。
-    int env_i_global = env_add(ctx, -1, ctx->fun_i_main);
-    frame_push(ctx, ctx->cmd_i_exit, env_i_global, ctx->tok_i_eof);
-
-    eval_cmds(ctx);
-}
-
-// ###############################################
-// 組み込み関数
-// ###############################################
+    free(extern_map);
 
-#define xargs extern_frame_args(ctx)
-#define xarg_nth(i) (cell_get(ctx, xargs->cell_l + (i)))
-#define xarg_ty(i) (xarg_nth(i)->ty)
-#define xarg_val(i) (xarg_nth(i)->val)
-
-static void builtin_val_type(Ctx *ctx, int argc) {
-    if (argc != 1) {
-        extern_frame_reject(ctx, "val_type error");
-        return;
+    for (int i = 0; i < fun_len; i++) {
+        const Fun *fun = &ctx->funs.data[i];
+        if (fun->kind == fun_kind_closure &&
+            (fun->cmd_i < 0 || fun->cmd_i >= cmd_len)) {
+            r->err = true;
+        }
     }
 
-    extern_frame_resolve(ctx, (Cell){.ty = ty_int, .val = xarg_ty(0)});
-}
-
-static void builtin_str_slice(Ctx *ctx, int argc) {
-    if (argc != 3 || xarg_ty(0) != ty_str || xarg_ty(1) != ty_int ||
-        xarg_ty(2) != ty_int) {
-        extern_frame_reject(ctx, "str_slice error");
-        return;
-    }
+    ctx->tok_i_eof = image_read_index(r, tok_len);
+    ctx->scope_i_global = image_read_index(r, scope_len);
+    ctx->fun_i_main = image_read_index(r, fun_len);
+    ctx->cmd_i_entry = image_read_index(r, cmd_len);
+    ctx->cmd_i_exit = image_read_index(r, cmd_len);
 
-    int str_i = xarg_val(0);
-    int l = xarg_val(1);
-    int r = xarg_val(2);
-    int str_slice_i = str_slice_fun(ctx, str_i, l, r);
-    extern_frame_resolve(ctx, (Cell){.ty = ty_str, .val = str_slice_i});
-}
+    r->err = r->err || !image_cmds_are_valid(ctx);
 
-static void builtin_array_len(Ctx *ctx, int argc) {
-    if (argc != 1 || xarg_ty(0) != ty_array) {
-        extern_frame_reject(ctx, "array_len error");
-        return;
+    // 命令リストの末尾から先に実行が進まないことを確かめる。
+    if (!r->err) {
+        CmdKind last = ctx->cmds.data[cmd_len - 1].kind;
+        r->err = ctx->cmds.data[ctx->cmd_i_exit].kind != cmd_exit ||
+                 (last != cmd_exit && last != cmd_jump && last != cmd_return);
     }
 
-    int len = array_get(ctx, xarg_val(0))->len;
-    extern_frame_resolve(ctx, (Cell){.ty = ty_int, .val = len});
-}
-
-static void builtin_array_push(Ctx *ctx, int argc) {
-    if (argc != 2 || xarg_ty(0) != ty_array) {
-        extern_frame_reject(ctx, "array_push error");
-        return;
+    if (r->err || r->pos != r->len) {
+        negi_lang_program_delete(program);
+        return NULL;
     }
 
-    array_push(ctx, xarg_val(0), *xarg_nth(1));
+    return program;
 }
 
-static void builtin_array_pop(Ctx *ctx, int argc) {
-    if (argc != 1 || xarg_ty(0) != ty_array) {
-        extern_frame_reject(ctx, "array_pop error");
-        return;
+bool negi_lang_program_save_file(const NegiLangProgram *program,
+                                 const char *file_name) {
+    int size;
+    void *image = negi_lang_program_save(program, &size);
+
+    FILE *file = fopen(file_name, "wb");
+    if (file == NULL) {
+        free(image);
+        return false;
     }
 
-    array_pop(ctx, xarg_val(0));
+    bool ok = fwrite(image, 1, size, file) == (size_t)size;
+    ok = fclose(file) == 0 && ok;
+    free(image);
+    return ok;
 }
 
-static void builtin_assert(Ctx *ctx, int argc) {
-    if (argc != 1 || xarg_ty(0) != ty_int) {
-        extern_frame_reject(ctx, "assert error");
-        return;
+NegiLangProgram *negi_lang_program_load_file(const char *file_name,
+                                             const NegiLangRegistry *registry) {
+    FILE *file = fopen(file_name, "rb");
+    if (file == NULL) {
+        return NULL;
     }
 
-    int ok = xarg_val(0);
-    if (!ok) {
-        extern_frame_reject(ctx, "assertion violated");
-        return;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
     }
-}
-
-static void builtin_stdin_to_str(Ctx *ctx, int argc) {
-    if (argc != 0) {
-        extern_frame_reject(ctx, "stdin_to_str error");
-        return;
+    if (size < 0 || size > INT32_MAX || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return NULL;
     }
 
-    int str_i = str_add(ctx, ctx->externals->stdin_to_str());
-    extern_frame_resolve(ctx, (Cell){.ty = ty_str, .val = str_i});
-}
+    char *image = mem_alloc(size + 1, sizeof(char));
+    bool ok = fread(image, 1, size, file) == (size_t)size;
+    fclose(file);
 
-static void extern_fun_builtin(Ctx *ctx) {
-    extern_fun_add(ctx, "val_type", builtin_val_type);
-    extern_fun_add(ctx, "str_slice", builtin_str_slice);
-    extern_fun_add(ctx, "array_len", builtin_array_len);
-    extern_fun_add(ctx, "array_push", builtin_array_push);
-    extern_fun_add(ctx, "array_pop", builtin_array_pop);
-    extern_fun_add(ctx, "assert", builtin_assert);
-    extern_fun_add(ctx, "stdin_to_str", builtin_stdin_to_str);
+    NegiLangProgram *program =
+        ok ? negi_lang_program_load(image, (int)size, registry) : NULL;
+    free(image);
+    return program;
 }
 
 // ###############################################
 // テスト
 // ###############################################
 
-Ctx *ctx_new(const char *src) {
-    Ctx *ctx = mem_alloc(1, sizeof(Ctx));
-
-    *ctx = (Ctx){};
-
-    ctx->data = sb_new();
-
-    extern_fun_builtin(ctx);
-    src_initialize(ctx, src);
-    return ctx;
-}
-
 void negi_lang_test_util() {
     StringBuilder *sb = sb_new();
     sb_append(sb, "Hello");
@@ -2665,6 +5909,18 @@ void negi_lang_test_util() {
     assert(strcmp(sb_to_str(sb), "Hello, world!") == 0);
 }
 
+void negi_lang_test_builtins() {
+    // すべての組み込み関数が、名前から自身の要素番号で見つかる。
+    for (int i = 0; i < builtin_len(); i++) {
+        const char *name = builtin_get(i)->name;
+        assert(builtin_find(name, strlen(name)) == i);
+    }
+
+    assert(builtin_find("array_put", 9) == -1);
+    assert(builtin_find("val_type_", 9) == -1);
+    assert(builtin_find("", 0) == -1);
+}
+
 const char *negi_lang_tokenize_dump(const char *src) {
     Ctx *ctx = ctx_new(src);
 
@@ -2759,6 +6015,7 @@ const char *negi_lang_gen_dump(const char *src) {
 
     tokenize(ctx);
     parse(ctx);
+    optimize(ctx);
     gen(ctx);
 
     StringBuilder *sb = sb_new();
@@ -2770,37 +6027,55 @@ const char *negi_lang_gen_dump(const char *src) {
             sb_append(sb, string_format("// %s\n", text));
         }
 
+        // ジャンプ先と対応させるため、命令番号を書いておく。
+        sb_append(sb, string_format("%d:", i));
+
         switch (cmd->kind) {
         case cmd_err:
             sb_append(sb,
                       string_format("  err \"%s\"\n", data_get(ctx, cmd->x)));
             break;
-        case cmd_label:
-            sb_append(sb, string_format("%d:\n", cmd->x));
+        case cmd_jump:
+        case cmd_jump_unless:
+        case cmd_jump_if:
+        case cmd_jump_if_eq:
+        case cmd_jump_if_ne:
+        case cmd_jump_if_lt:
+        case cmd_jump_if_le:
+        case cmd_jump_if_gt:
+        case cmd_jump_if_ge:
+            sb_append(sb, string_format("  %d -> %d\n", cmd->kind, cmd->x));
+            break;
+        case cmd_local_ref:
+        case cmd_load_local:
+        case cmd_store_local:
+        case cmd_store_local_pop:
+        case cmd_inc_local:
+        case cmd_call_extern:
+            sb_append(sb, string_format("  %d %d %d\n", cmd->kind, cmd->x,
+                                        cmd->y));
+            break;
+        case cmd_push_str:
+            sb_append(sb, string_format("  %d %d (\"%s\")\n", cmd->kind,
+                                        cmd->x, data_get(ctx, cmd->x)));
             break;
         default: {
-            if (0 <= cmd->x && cmd->x < ctx->data->size - 2) {
-                sb_append(sb, string_format("  %d %d (\"%s\")\n", cmd->kind,
-                                            cmd->x, data_get(ctx, cmd->x)));
-                break;
-            }
             sb_append(sb, string_format("  %d %d\n", cmd->kind, cmd->x));
             break;
         }
         }
     }
+
+    sb_append(sb, string_format("// peephole: %d removed\n",
+                                ctx->peephole_removed));
     return sb_to_str(sb);
 }
 
 void negi_lang_eval_for_testing(NegiLangExternals *externals) {
-    Ctx *ctx = ctx_new(externals->src);
-    ctx->externals = externals;
-
-    tokenize(ctx);
-    parse(ctx);
-    gen(ctx);
-    eval(ctx);
+    NegiLangProgram *program = negi_lang_compile(externals->src, NULL);
+    Ctx *ctx = negi_lang_context_new(program);
 
-    *externals->exit_code = ctx->exit_code;
-    *externals->output = err_summary(ctx);
+    negi_lang_run(ctx, externals);
+    negi_lang_context_delete(ctx);
+    negi_lang_program_delete(program);
 }
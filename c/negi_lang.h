@@ -1,18 +1,156 @@
 // LICENSE: CC0-1.0 <https://creativecommons.org/publicdomain/zero/1.0/deed.ja>
 
-#ifndef NEIG_LANG_H
+#ifndef NEGI_LANG_H
 #define NEGI_LANG_H
 
 // ネギ言語処理系 ヘッダー
 
+#include <stdbool.h>
+
+// プログラムの実行状態。
 struct NegiLangContext;
 
+// コンパイル済みのプログラム。
+typedef struct NegiLangProgram NegiLangProgram;
+
+// ホストが提供する外部関数の登録簿。
+typedef struct NegiLangRegistry NegiLangRegistry;
+
+// 値の型タグ。(組み込み関数 val_type が返す値と同じ。)
+// 外部関数が読み書きできる型だけを公開する。
+typedef enum NegiLangTy {
+    negi_lang_ty_int = 1,
+    negi_lang_ty_str = 2,
+    negi_lang_ty_array = 3,
+} NegiLangTy;
+
+// 値。ty は値の型タグ、val は整数の値か、値の種類ごとのリストの要素番号。
+typedef struct NegiLangCell {
+    int ty, val;
+} NegiLangCell;
+
+// 外部関数。
+// args は呼び出し元のスタックに積まれた argc 個の引数を借用したもので、
+// 呼び出しの間だけ有効。(値を生成するとヒープ領域が移動しうるので、先に読むこと。)
+// 戻り値は *result に書き込む。書き込まなければ 0 になる。
+// 成功したら NULL を、失敗したらエラーメッセージを返す。
+typedef const char *(*NegiLangExternFun)(struct NegiLangContext *ctx,
+                                         const NegiLangCell *args, int argc,
+                                         NegiLangCell *result);
+
 typedef struct NegiLangExternals {
     const char *src;
     const char **output;
     int *exit_code;
 
     const char *(*stdin_to_str)();
+
+    // ヒープ領域の参照セルの個数の上限。0 なら既定値を使う。
+    int heap_len_max;
 } NegiLangExternals;
 
+// 整数の値を生成する。
+extern NegiLangCell negi_lang_cell_int(int value);
+
+// 文字列の値を生成する。文字列は複製される。
+// 外部関数の中で戻り値を作るために使う。
+extern NegiLangCell negi_lang_cell_str(struct NegiLangContext *ctx,
+                                       const char *str);
+
+// 文字列の値の内容を得る。文字列でなければ NULL を返す。
+// 返り値はコンテクストが所有していて、外部関数の呼び出しの間だけ有効。
+extern const char *negi_lang_cell_str_value(struct NegiLangContext *ctx,
+                                            NegiLangCell cell);
+
+// 覗き穴最適化の規則。
+typedef enum NegiLangPeepholeRule {
+    // 比較の結果の否定や、オペランドを交換した比較を、1つの比較にまとめる。
+    negi_lang_peephole_cmp = 1 << 0,
+
+    // 値を設定した直後に下ろす命令を、1つの命令にまとめる。
+    negi_lang_peephole_set_pop = 1 << 1,
+
+    // 副作用のない値を積んだ直後に下ろす命令を取り除く。
+    negi_lang_peephole_push_pop = 1 << 2,
+
+    // 直後のラベルへのジャンプを取り除く。
+    negi_lang_peephole_jump_next = 1 << 3,
+
+    negi_lang_peephole_all = (1 << 4) - 1,
+} NegiLangPeepholeRule;
+
+// コンパイルの設定。すべて 0 なら既定の設定になる。
+typedef struct NegiLangCompileOptions {
+    // 無効にする覗き穴最適化の規則 (NegiLangPeepholeRule の論理和)
+    // NEGI_LANG_NO_PEEPHOLE を定義してビルドしたなら、すべての規則が無効になる。
+    int peephole_disabled;
+} NegiLangCompileOptions;
+
+// 空の登録簿を生成する。
+extern NegiLangRegistry *negi_lang_registry_new();
+
+// 登録簿を破棄する。
+// この登録簿を使うプログラムとコンテクストは、先に破棄しなければいけない。
+extern void negi_lang_registry_delete(NegiLangRegistry *registry);
+
+// 外部関数を登録する。同じ名前の組み込み関数より優先される。
+// すでに登録された名前なら、関数を置き換える。
+// arity は引数の個数で、名前で直接呼び出す箇所はコンパイル時に検査される。
+// 負の値なら個数を検査しない。
+extern void negi_lang_registry_add(NegiLangRegistry *registry,
+                                   const char *name, int arity,
+                                   NegiLangExternFun fun);
+
+// ソースコードをコンパイルする。
+// 外部関数の名前はコンパイル時に解決される。登録簿は NULL でもよく、
+// 指定したならプログラムより長く生存しなければいけない。
+// コンパイルエラーはプログラムの実行時に報告される。
+extern NegiLangProgram *negi_lang_compile(const char *src,
+                                          const NegiLangRegistry *registry);
+
+// 設定を指定してソースコードをコンパイルする。options は NULL でもよい。
+extern NegiLangProgram *
+negi_lang_compile_with_options(const char *src,
+                               const NegiLangRegistry *registry,
+                               const NegiLangCompileOptions *options);
+
+// プログラムを実行するためのコンテクストを生成する。
+// 1つのプログラムから、独立したコンテクストをいくつでも生成できる。
+extern struct NegiLangContext *
+negi_lang_context_new(const NegiLangProgram *program);
+
+// プログラムを最初から実行して、終了コードを返す。
+// エラーの一覧と終了コードは externals->output, externals->exit_code
+// にも書き込む。(externals->src は使わない。)
+// 同じコンテクストで繰り返し実行でき、前回の実行で確保した領域は再利用される。
+extern int negi_lang_run(struct NegiLangContext *ctx,
+                         NegiLangExternals *externals);
+
+// コンテクストを破棄する。プログラムは破棄しない。
+extern void negi_lang_context_delete(struct NegiLangContext *ctx);
+
+// プログラムを破棄する。
+// このプログラムから生成したコンテクストは、先に破棄しなければいけない。
+extern void negi_lang_program_delete(NegiLangProgram *program);
+
+// コンパイル済みのプログラムをバイトコードのイメージに変換する。
+// イメージのバイト数を *size に書き込む。返り値は free で解放する。
+extern void *negi_lang_program_save(const NegiLangProgram *program, int *size);
+
+// バイトコードのイメージからプログラムを復元する。
+// 外部関数は名前によって、組み込み関数か登録簿の関数に束縛し直す。
+// イメージが壊れているか、バージョンが異なるか、
+// プログラムが使う外部関数が見つからないなら NULL を返す。
+extern NegiLangProgram *negi_lang_program_load(
+    const void *image, int size, const NegiLangRegistry *registry);
+
+// イメージをファイルに保存する。失敗したら false を返す。
+extern bool negi_lang_program_save_file(const NegiLangProgram *program,
+                                        const char *file_name);
+
+// ファイルからイメージを読み込む。失敗したら NULL を返す。
+extern NegiLangProgram *
+negi_lang_program_load_file(const char *file_name,
+                            const NegiLangRegistry *registry);
+
 #endif
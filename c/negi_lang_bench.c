@@ -0,0 +1,97 @@
+// LICENSE: CC0-1.0 <https://creativecommons.org/publicdomain/zero/1.0/deed.ja>
+
+// ネギ言語処理系のベンチマーク
+// benches.toml に書かれたスクリプトを実行して、所要時間を表示する。
+
+#include "negi_lang.h"
+#include "negi_lang_internals.h"
+#include "tomlc99/toml.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *stdin_to_str() { return ""; }
+
+static char *file_read_all(const char *file_name) {
+    FILE *file = fopen(file_name, "r");
+    if (!file) {
+        fprintf(stderr, "File '%s' not found.", file_name);
+        abort();
+    }
+
+    fseek(file, 0, SEEK_END);
+    int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *content = calloc(size + 1, sizeof(char));
+    fread(content, 1, size, file);
+
+    fclose(file);
+    return content;
+}
+
+static double time_now() { return (double)clock() / CLOCKS_PER_SEC; }
+
+int main(int argc, char **argv) {
+    const int toml_success = 0;
+    const char *file_name = "benches.toml";
+    const int repeat = 3;
+
+    char err_buf[1024];
+
+    char *toml = file_read_all(file_name);
+    toml_table_t *top = toml_parse(toml, err_buf, sizeof(err_buf));
+    if (top == NULL) {
+        fprintf(stderr, "Error in '%s':\n%s\n", file_name, err_buf);
+        abort();
+    }
+
+    const char *mode = argc >= 2 ? argv[1] : "";
+
+    toml_array_t *benches = toml_array_in(top, "bench");
+    for (int i = 0; i < toml_array_nelem(benches); i++) {
+        toml_table_t *bench = toml_table_at(benches, i);
+
+        char *name;
+        if (toml_rtos(toml_raw_in(bench, "name"), &name) != toml_success) {
+            name = "anonymous";
+        }
+
+        char *src;
+        if (toml_rtos(toml_raw_in(bench, "src"), &src) != toml_success) {
+            fprintf(stderr, "bench[%d].src is missing (name = %s)\n", i, name);
+            continue;
+        }
+
+        // コンパイルは1回だけ行い、同じコンテクストで繰り返し実行する。
+        NegiLangProgram *program = negi_lang_compile(src, NULL);
+        struct NegiLangContext *ctx = negi_lang_context_new(program);
+
+        // 最も速かった回の時間を採用する。
+        double best = -1;
+        int exit = 0;
+        for (int k = 0; k < repeat; k++) {
+            const char *err;
+            NegiLangExternals externals = (NegiLangExternals){
+                .exit_code = &exit,
+                .output = &err,
+                .stdin_to_str = stdin_to_str,
+            };
+
+            double start = time_now();
+            negi_lang_run(ctx, &externals);
+            double elapsed = time_now() - start;
+
+            if (best < 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        negi_lang_context_delete(ctx);
+        negi_lang_program_delete(program);
+
+        printf("%s %8.1f ms  (exit = %d) %s\n", mode, best * 1000, exit, name);
+    }
+
+    return EXIT_SUCCESS;
+}
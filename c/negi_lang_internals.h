@@ -3,10 +3,12 @@
 #ifndef NEGI_LANG_INTERNALS_H
 #define NEGI_LANG_INTERNALS_H
 
+#include "negi_lang.h"
+#include "utils.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct NegiLangContext Ctx;
-typedef struct StringBuilder StringBuilder;
 
 // ###############################################
 // 定数
@@ -229,16 +231,37 @@ typedef enum CmdKind {
     // 終了
     cmd_exit,
 
-    // ラベル
+    // ラベル (リンク時に取り除かれる)
+    // x: ラベル番号
     cmd_label,
 
+    // ジャンプ
+    // x: ジャンプ先 (リンク前はラベル番号、リンク後は命令番号)
+    cmd_jump,
+
     // スタック上の値が false ならジャンプ
+    // x: cmd_jump と同じ
     cmd_jump_unless,
 
+    // スタック上の値が true ならジャンプ
+    // x: cmd_jump と同じ
+    cmd_jump_if,
+
+    // スタック上の2つの値を下ろして比較し、成り立つならジャンプ
+    // 両方が整数なら比較を直接行い、そうでなければ cmd_op と同様に比較する。
+    // x: cmd_jump と同じ
+    cmd_jump_if_eq,
+    cmd_jump_if_ne,
+    cmd_jump_if_lt,
+    cmd_jump_if_le,
+    cmd_jump_if_gt,
+    cmd_jump_if_ge,
+
     // 整数リテラルをスタックにプッシュ
     cmd_push_int,
 
     // 文字列リテラルをスタックにプッシュ
+    // x: 定数番号
     cmd_push_str,
 
     // 空の配列を生成してプッシュする
@@ -252,13 +275,39 @@ typedef enum CmdKind {
     // 外部関数をプッシュする
     cmd_push_extern,
 
-    // 実行環境をプッシュする
-    // x: 何番目の親環境か (現環境を 0 とする)
-    cmd_push_env,
+    // ローカル変数の参照セルをプッシュする
+    // x, y: cmd_load_local と同じ
+    cmd_local_ref,
 
-    // スタックの一番上にある実行環境に含まれるローカル変数の参照セルをプッシュ
+    // ローカル変数の値をプッシュする
     // x: 何番目の変数か
-    cmd_local_var,
+    // y: 変数の置き場所 (VarKind)
+    cmd_load_local,
+
+    // スタックの一番上にある値をローカル変数に設定する (値は残す)
+    // x, y: cmd_load_local と同じ
+    cmd_store_local,
+
+    // スタックの一番上にある値を下ろして、ローカル変数に設定する
+    // (cmd_store_local; cmd_pop を融合したもの)
+    // x, y: cmd_load_local と同じ
+    cmd_store_local_pop,
+
+    // グローバル変数の値をプッシュする
+    // x: 何番目のグローバル変数か
+    cmd_load_global,
+
+    // スタックの一番上にある値をグローバル変数に設定する (値は残す)
+    // x: cmd_load_global と同じ
+    cmd_store_global,
+
+    // スタックの一番上にある値を下ろして、グローバル変数に設定する
+    // x: cmd_load_global と同じ
+    cmd_store_global_pop,
+
+    // スタックの一番上にある値をローカル変数に加算して、結果と置き換える
+    // x, y: cmd_load_local と同じ
+    cmd_inc_local,
 
     // スタックの一番上にある参照セルの値を取得する
     cmd_cell_get,
@@ -266,6 +315,20 @@ typedef enum CmdKind {
     // スタックの一番上にある値を、その下にある参照セルに設定する
     cmd_cell_set,
 
+    // スタックの一番上にある値を、その下にある参照セルに設定して、両方を下ろす
+    // (cmd_cell_set; cmd_pop を融合したもの)
+    cmd_cell_set_pop,
+
+    // 配列、要素番号、値の3つを下ろして、配列の要素に設定し、設定した値を積む
+    // 参照セルを経由しないので、詰めた配列も展開せずに設定できる。
+    // x: 演算子の種類 (op_set なら代入、そうでなければ複合代入の演算子)
+    cmd_index_set,
+
+    // 配列の要素に設定して、値を積まない
+    // (cmd_index_set; cmd_pop を融合したもの)
+    // x: cmd_index_set と同じ
+    cmd_index_set_pop,
+
     // スタックの一番上の要素を捨てる
     cmd_pop,
 
@@ -279,13 +342,65 @@ typedef enum CmdKind {
     // x: 引数の個数
     cmd_call,
 
+    // 末尾呼び出し (cmd_call; cmd_return を融合したもの)
+    // 呼び出し元のフレームを再利用し、戻り先を引き継ぐ。
+    // x: 引数の個数
+    cmd_tail_call,
+
+    // コンパイル時に解決された外部関数の呼び出し (関数はスタックに積まない)
+    // x: 引数の個数
+    // y: 外部関数番号
+    cmd_call_extern,
+
+    // 以下の命令は、名前で直接呼び出された組み込み関数を実行する。(intrinsic)
+    // 組み込み関数と同じく、引数を下ろして結果をプッシュする。
+    cmd_val_type,
+    cmd_str_slice,
+    cmd_array_len,
+    cmd_array_push,
+    cmd_array_pop,
+
     // 関数から戻る
     cmd_return,
 
     // 演算
+    // x: 演算子の種類
+    // y: 0 でなければ、整数専用の命令に書き換えない
     cmd_op,
+
+    // 以下の命令は実行時に cmd_op を書き換えて作られる。(quickening)
+    // 両方のオペランドが整数なら直接計算し、そうでなければ cmd_op に戻る。
+    cmd_op_add_int,
+    cmd_op_sub_int,
+    cmd_op_mul_int,
+    cmd_op_eq_int,
+    cmd_op_ne_int,
+    cmd_op_lt_int,
+    cmd_op_le_int,
+    cmd_op_gt_int,
+    cmd_op_ge_int,
+
+    // 詰めた配列の要素の取得 (op_index)
+    // 詰めた配列と整数なら直接取得し、そうでなければ cmd_op に戻る。
+    cmd_op_index_packed,
 } CmdKind;
 
+// -----------------------------------------------
+// 変数の置き場所
+// -----------------------------------------------
+
+typedef enum VarKind {
+    // 実行中の関数のローカル変数
+    var_local,
+
+    // クロージャが捕獲した変数
+    var_upval,
+
+    // グローバル変数
+    // ヒープ領域の先頭に置かれ、GC で移動しないので、セル番号が固定される。
+    var_global,
+} VarKind;
+
 // -----------------------------------------------
 // 値の型タグ
 // -----------------------------------------------
@@ -305,7 +420,7 @@ typedef enum TyKind {
     // クロージャ。値は s_closures の要素番号。
     ty_closure,
 
-    // 外部関数。値は s_extern_funs の要素番号。
+    // 外部関数。値は外部関数番号。
     ty_extern,
 
     ty_env,
@@ -337,12 +452,42 @@ enum {
     // 参照セル領域のうちヒープに割り当てられる個数の初期値。(1MB)
     heap_len_min = 1024 * 1024 / 4,
 
+    // 参照セル領域のうちヒープに割り当てられる個数の上限の既定値。(256MB)
+    heap_len_max_default = 256 * 1024 * 1024 / 4,
+
     // 参照セル領域の長さの既定値。
     cell_len_min = stack_len_min + heap_len_min,
 
+    // フレームの個数の上限。
+    // 環境を生成する関数は引数をスタック領域に残さないので、呼び出しの深さはこれで制限する。
+    frame_len_max = stack_len_min,
+
+    // 配列を広げるときの容量の最小値。
+    array_capacity_min = 4,
+
+    // 参照セルの外に確保した領域について、GC を実行するバイト数の最小値。(4MB)
+    gc_malloc_threshold_min = 4 * 1024 * 1024,
+
+    // ヒープが上限に達しているとき、GC の後の空きがヒープのこの割合 (1/16)
+    // に満たなければメモリ不足とする。
+    gc_free_ratio_min = 16,
+
     s_cell_i_stack_max = stack_len_min,
 };
 
+// -----------------------------------------------
+// 覗き穴最適化の規則
+// -----------------------------------------------
+
+// 各規則の説明は negi_lang.h の NegiLangPeepholeRule を参照。
+typedef enum PeepholeRule {
+    peephole_cmp = negi_lang_peephole_cmp,
+    peephole_set_pop = negi_lang_peephole_set_pop,
+    peephole_push_pop = negi_lang_peephole_push_pop,
+    peephole_jump_next = negi_lang_peephole_jump_next,
+    peephole_all = negi_lang_peephole_all,
+} PeepholeRule;
+
 // ###############################################
 // エラー
 // ###############################################
@@ -365,6 +510,9 @@ typedef struct Errs {
 typedef struct Tok {
     enum TokKind kind;
     int src_l, src_r;
+
+    // 識別子のシンボル番号 (識別子でなければ -1)
+    int sym_i;
 } Tok;
 
 typedef struct Toks {
@@ -373,6 +521,26 @@ typedef struct Toks {
     int capacity;
 } Toks;
 
+// -----------------------------------------------
+// シンボルリスト
+// -----------------------------------------------
+
+// 識別子の文字列。同じ綴りの識別子は同じシンボルを共有する。
+typedef struct Sym {
+    // ゼロ終端の文字列
+    const char *text;
+    int len;
+
+    // コード生成中に、この名前で参照できるローカル番号 (なければ -1)
+    int local_i;
+} Sym;
+
+typedef struct VecSym {
+    Sym *data;
+    int len;
+    int capacity;
+} VecSym;
+
 // ###############################################
 // 構文解析
 // ###############################################
@@ -416,6 +584,24 @@ typedef struct Exps {
 // コード生成
 // ###############################################
 
+// -----------------------------------------------
+// 定数リスト
+// -----------------------------------------------
+
+// データ領域に置かれた定数。
+typedef struct Const {
+    // データ領域における位置
+    int offset;
+    // 文字列の長さ
+    int len;
+} Const;
+
+typedef struct VecConst {
+    Const *data;
+    int len;
+    int capacity;
+} VecConst;
+
 // -----------------------------------------------
 // ラベルリスト
 // -----------------------------------------------
@@ -442,6 +628,15 @@ typedef struct Scope {
     int len;
 
     int tok_i;
+
+    // トップレベルのスコープから何段階内側にあるか
+    int depth;
+
+    // スコープに入ったときの束縛スタックの長さ
+    int binding_len;
+
+    // 内側の関数に捕獲されたローカル変数があるか
+    bool captured;
 } Scope;
 
 typedef struct VecScope {
@@ -465,6 +660,12 @@ typedef struct Local {
     int index;
 
     int tok_i;
+
+    // 識別子のシンボル番号
+    int sym_i;
+
+    // このローカルが束縛される前に、同じ名前で参照できたローカル番号 (なければ -1)
+    int shadowed_local_i;
 } Local;
 
 typedef struct VecLocal {
@@ -490,6 +691,13 @@ typedef struct Fun {
 
     // 関数の本体を指すコマンド位置 (クロージャのみ、コード生成後のみ)
     int cmd_i;
+
+    // ローカル変数を環境ではなくスタック領域に置くか (クロージャのみ)
+    // 内側の関数に捕獲されるローカル変数がなければ、スタック領域に置く。
+    bool stack_locals;
+
+    // クロージャが捕獲する変数の範囲 (捕獲変数リストの添字)
+    int upval_l, upval_len;
 } Fun;
 
 typedef struct VecFun {
@@ -498,14 +706,41 @@ typedef struct VecFun {
     int capacity;
 } VecFun;
 
+// -----------------------------------------------
+// 捕獲変数
+// -----------------------------------------------
+
+// クロージャが捕獲する変数。
+// クロージャを生成する関数から見た位置を持ち、生成時にその変数の参照セルを集める。
+typedef struct Upval {
+    // 変数を捕獲する関数のスコープ番号
+    int scope_i;
+
+    // 捕獲される変数のローカル番号
+    int local_i;
+
+    // 生成する関数のローカル変数なら true、生成する関数が捕獲した変数なら false
+    bool from_local;
+
+    // ローカル変数の番号、または捕獲変数の番号
+    int index;
+} Upval;
+
+typedef struct VecUpval {
+    Upval *data;
+    int len, capacity;
+} VecUpval;
+
 // -----------------------------------------------
 // 外部関数リスト
 // -----------------------------------------------
 
-typedef void (*extern_fun_t)(Ctx *ctx, int argc);
+typedef NegiLangExternFun extern_fun_t;
 
 typedef struct ExternFun {
     const char *name;
+    // 引数の個数 (負なら検査しない)
+    int arity;
     extern_fun_t fun;
 } ExternFun;
 
@@ -515,17 +750,13 @@ typedef struct VecExternFun {
     int capacity;
 } VecExternFun;
 
-// -----------------------------------------------
-// 外部関数フレーム
-// -----------------------------------------------
-
-typedef struct ExternFrame {
-    bool err;
-    const char *err_message;
-
-    int arg_array_i;
-    int result_cell_i;
-} ExternFrame;
+// 外部関数の登録簿。
+// 外部関数番号は、組み込み関数の番号の後ろに、登録簿の要素番号を続けたもの。
+struct NegiLangRegistry {
+    VecExternFun funs;
+    // 名前から funs の要素番号へのハッシュテーブル
+    StrMap map;
+};
 
 // -----------------------------------------------
 // ループスタック
@@ -548,7 +779,7 @@ typedef struct VecLoop {
 
 typedef struct Cmd {
     CmdKind kind;
-    int x;
+    int x, y;
     int tok_i;
 } Cmd;
 
@@ -566,9 +797,7 @@ typedef struct VecCmd {
 // 参照セル
 // -----------------------------------------------
 
-typedef struct Cell {
-    int ty, val;
-} Cell;
+typedef struct NegiLangCell Cell;
 
 typedef struct VecCell {
     Cell *data;
@@ -584,9 +813,20 @@ typedef struct Frame {
     // return した直後に実行するコマンド番号
     int cmd_i;
 
-    // 実行中の環境番号
+    // ローカル変数を置いた環境番号 (スタック領域に置いたときは -1)
     int env_i;
 
+    // ローカル変数を置いたスタック領域の先頭の位置 (環境に置いたときは -1)
+    // 先頭の引数がそのまま最初のローカル変数になる。
+    // 1つ手前には呼ばれた関数の値があり、戻り値はそこに置かれる。
+    int base;
+
+    // 実行中のクロージャ番号 (トップレベルなら -1)
+    int closure_i;
+
+    // 捕獲変数の参照セルが並ぶ領域の先頭のセル番号
+    int upvals;
+
     int tok_i;
 } Frame;
 
@@ -602,6 +842,10 @@ typedef struct VecFrame {
 typedef struct Str {
     char *data;
     int len, capacity;
+
+    // この文字列を唯一参照している参照セルの番号 (なければ -1)
+    // 所有者のセルへの加算代入は、文字列を複製せずにその場で追記する。
+    int owner;
 } Str;
 
 typedef struct VecStr {
@@ -619,6 +863,13 @@ typedef struct Array {
 
     // 配列の長さ
     int len;
+
+    // 要素が整数だけなら、参照セルではなく ints に詰めて格納する。
+    // 詰めた配列は参照セルを持たない。(cell_l == cell_r)
+    // 整数でない値を格納するときに、参照セルに展開する。
+    bool packed;
+    int *ints;
+    int ints_capacity;
 } Array;
 
 typedef struct VecArray {
@@ -631,13 +882,13 @@ typedef struct VecArray {
 // -----------------------------------------------
 
 typedef struct Env {
-    // 親となる環境番号 (なければ -1)
-    int parent;
-
     int scope_i;
 
     // 引数やローカル変数を格納する配列番号
     int array_i;
+
+    // ローカル変数がクロージャに捕獲されたか (捕獲された環境は末尾呼び出しで再利用しない)
+    bool captured;
 } Env;
 
 typedef struct VecEnv {
@@ -652,8 +903,8 @@ typedef struct VecEnv {
 typedef struct Closure {
     // クロージャに対応する関数番号
     int fun_i;
-    // クロージャが生成された環境番号
-    int env_i;
+    // 捕獲した変数の参照セルを並べた配列番号
+    int upval_array_i;
 } Closure;
 
 typedef struct VecClosure {
@@ -661,10 +912,66 @@ typedef struct VecClosure {
     int len, capacity;
 } VecClosure;
 
+// -----------------------------------------------
+// ガベージコレクション
+// -----------------------------------------------
+
+// GC の作業領域。要素の意味は GC の段階によって異なる。
+// マーク: マーク済みなら 1、そうでなければ 0
+// ムーブ: 移動先の要素番号 (破棄されたなら -1)
+typedef struct GcMap {
+    int *data;
+    int len, capacity;
+} GcMap;
+
+// ###############################################
+// バイトコードのイメージ
+// ###############################################
+
+enum {
+    // イメージの先頭に置かれる識別子 ("NEGI")
+    image_magic = 0x4947454e,
+
+    // イメージの形式のバージョン。命令の種類や意味を変えたら増やす。
+    image_version = 10,
+};
+
+// イメージを書き出すバッファ。
+typedef struct ImageWriter {
+    char *data;
+    int len, capacity;
+} ImageWriter;
+
+// イメージを読み込むカーソル。
+// 範囲外の読み込みや不正な値があったら err を立てて、以降の読み込みは失敗させる。
+typedef struct ImageReader {
+    const char *data;
+    int len;
+    int pos;
+    bool err;
+} ImageReader;
+
+// イメージの命令を、関数の入り口から実行順に辿るための作業領域。
+typedef struct ImageFlow {
+    int cmd_len;
+    // 命令ごとの、その命令を実行する関数 (未到達なら -1)
+    int *funs;
+    // 命令ごとの、その命令を実行する直前のフレーム内のスタックの深さの最小値
+    int *depths;
+    // これから検査する命令の番号のスタック
+    VecInt stack;
+} ImageFlow;
+
 // ###############################################
 // コンテクスト
 // ###############################################
 
+// コンパイル済みのプログラム。
+// 実行用のコンテクストはこれを原本として生成され、コンパイル結果を共有する。
+struct NegiLangProgram {
+    Ctx *ctx;
+};
+
 struct NegiLangContext {
     // ソースコード。
     const char *src;
@@ -672,29 +979,54 @@ struct NegiLangContext {
 
     // データ領域。文字列定数の内容を改行区切りで羅列したもの。
     StringBuilder *data;
+    // 定数リスト。命令は定数をこの要素番号で指定する。
+    VecConst consts;
+    // 文字列から定数番号へのハッシュテーブル。同じ文字列の定数は共有する。
+    StrMap const_map;
 
     Errs errs;
+    // エラーリストの先頭にある、コンパイル時に報告されたエラーの個数。
+    int err_len_compile;
 
     Toks toks;
     int tok_i_root;
     int tok_i_eof;
+    // シンボルリスト。識別子の文字列からシンボル番号へのハッシュテーブル。
+    VecSym syms;
+    StrMap sym_map;
 
     SubExps subexps;
     Exps exps;
     int exp_i_root;
-    int exp_i_true;
-    int exp_i_false;
+    // 定数畳み込みで生成した文字列のリスト。プログラムを破棄するときに解放する。
+    char **opt_strs;
+    int opt_str_len, opt_str_capacity;
 
     VecLabel labels;
     VecScope scopes;
     int scope_i_global;
     int scope_i_current;
     VecLocal locals;
+    // 束縛スタック。シンボルの束縛を変更したローカル番号を順に積む。
+    // スコープを抜けるとき、そのスコープで積まれた分を巻き戻す。
+    VecInt bindings;
     VecFun funs;
+    // 関数ごとに並べた捕獲変数のリスト
+    VecUpval upvals;
+    // コード生成中の関数の捕獲変数のリスト
+    VecUpval upvals_gen;
     int fun_i_main;
-    VecExternFun extern_funs;
+    // ホストが提供する外部関数の登録簿 (なければ NULL)
+    const NegiLangRegistry *registry;
     VecLoop loops;
     VecCmd cmds;
+    // 有効な覗き穴最適化の規則 (PeepholeRule の論理和)
+    int peephole_rules;
+    // 覗き穴最適化によって取り除かれた命令の個数
+    int peephole_removed;
+    // 命令ごとの処理のアドレスのリスト (direct threading 用)
+    const void **code;
+    int code_len, code_capacity;
     int cmd_i_entry;
     int cmd_i_exit;
 
@@ -703,28 +1035,53 @@ struct NegiLangContext {
     int stack_end;
     // 参照セルリストのヒープ領域の末尾を指す。
     int heap_end;
-    // ガベージコレクションを実行する。
+    // ヒープ領域の長さの上限。これを超えて拡張しようとするとメモリ不足になる。
+    int heap_len_max;
+    // ヒープ領域の残りの個数がこの値以下になったら GC を実行する。
     int gc_threshold;
+    // 参照セルの外に確保した、GC が管理する領域のバイト数。(文字列のバッファなど)
+    // gc_malloc_threshold 以上になったら GC を実行する。
+    size_t gc_malloc_bytes;
+    size_t gc_malloc_threshold;
     // フレームのスタック。
     VecFrame frames;
     VecStr strs;
+    // 文字列リストの先頭にある、定数から生成された文字列の個数。
+    // これらは不変であり、GC で移動も破棄もされない。
+    int str_len_const;
     VecArray arrays;
     VecEnv envs;
     VecClosure closures;
 
+    // GC の作業領域。
+    GcMap gc_cell_map;
+    GcMap gc_str_map;
+    GcMap gc_array_map;
+    GcMap gc_env_map;
+    GcMap gc_closure_map;
+    // マーク済みで、参照先をまだマークしていない値のスタック。
+    VecCell gc_stack;
+
+    // 外部関数を実行中か。
     bool extern_calling;
-    ExternFrame extern_frame;
+
+    // グローバル環境の環境番号。
+    // グローバル変数はこの環境の固定されたセルに置かれるので、常に GC のルートになる。
+    int env_i_global;
 
     // プログラムカウンタ。次に実行するコマンド番号。
     int pc;
     // ガベージコレクションを実行するか。
     bool does_gc;
+    // 実行時エラーにより中断されたか。
+    bool aborted;
     int exit_code;
 
     NegiLangExternals *externals;
 };
 
 extern void negi_lang_test_util();
+extern void negi_lang_test_builtins();
 extern const char *negi_lang_tokenize_dump(const char *src);
 extern const char *negi_lang_parse_dump(const char *src);
 extern const char *negi_lang_gen_dump(const char *src);
@@ -128,7 +128,518 @@ static void parse_tests() {
     }
 };
 
-void some_tests() { negi_lang_test_util(); }
+// 1つのプログラムを、複数のコンテクストで繰り返し実行できる。
+static void test_program_reuse() {
+    NegiLangProgram *program = negi_lang_compile(
+        "let a = [];"
+        "let s = \"\";"
+        "let i = 0;"
+        "while (i < 100000) { array_push(a, [i]); s += \"x\"; i += 1 };"
+        "a[99999][0] == 99999 && s == str_slice(s + s, 0, 100000) ? 7 : 1",
+        NULL);
+
+    struct NegiLangContext *ctx1 = negi_lang_context_new(program);
+    struct NegiLangContext *ctx2 = negi_lang_context_new(program);
+
+    for (int k = 0; k < 3; k++) {
+        int exit = 0;
+        const char *err = NULL;
+        NegiLangExternals externals = (NegiLangExternals){
+            .exit_code = &exit,
+            .output = &err,
+            .stdin_to_str = stdin_to_str,
+        };
+
+        assert(negi_lang_run(k % 2 == 0 ? ctx1 : ctx2, &externals) == 7);
+        assert(exit == 7 && strcmp(err, "") == 0);
+    }
+
+    negi_lang_context_delete(ctx1);
+    negi_lang_context_delete(ctx2);
+    negi_lang_program_delete(program);
+
+    // コンパイルエラーは実行のたびに1回だけ報告される。
+    program = negi_lang_compile("let x = ;", NULL);
+    ctx1 = negi_lang_context_new(program);
+    const char *err1 = NULL;
+    const char *err2 = NULL;
+    negi_lang_run(ctx1, &(NegiLangExternals){.output = &err1});
+    negi_lang_run(ctx1, &(NegiLangExternals){.output = &err2});
+    assert(strcmp(err1, "") != 0 && strcmp(err1, err2) == 0);
+    negi_lang_context_delete(ctx1);
+    negi_lang_program_delete(program);
+
+    negi_lang_program_delete(NULL);
+}
+
+static int run_program(NegiLangProgram *program, const char **err) {
+    struct NegiLangContext *ctx = negi_lang_context_new(program);
+
+    int exit = 0;
+    NegiLangExternals externals = (NegiLangExternals){
+        .exit_code = &exit,
+        .output = err,
+        .stdin_to_str = stdin_to_str,
+    };
+    negi_lang_run(ctx, &externals);
+
+    negi_lang_context_delete(ctx);
+    return exit;
+}
+
+// ソースコードをコンパイルして1回実行し、プログラムを破棄する。
+static int run_src(const char *src, const NegiLangRegistry *registry,
+                   const char **err) {
+    NegiLangProgram *program = negi_lang_compile(src, registry);
+    int exit = run_program(program, err);
+    negi_lang_program_delete(program);
+    return exit;
+}
+
+// バイトコードのイメージから復元したプログラムは、元のプログラムと同じように動く。
+static void test_program_image() {
+    const char *srcs[] = {
+        "let f = fun(n) { if (n <= 1) { return n }; f(n - 1) + f(n - 2) };"
+        "let s = \"fib\";"
+        "s += \"!\";"
+        "let a = [1, 2];"
+        "array_push(a, 3);"
+        "s == \"fib!\" && array_len(a) == 3 ? f(10) : 1",
+        "let x = 1;\nx = [] + 1;\nx",
+        "let x = ;",
+    };
+
+    for (int k = 0; k < (int)array_len(srcs); k++) {
+        NegiLangProgram *program = negi_lang_compile(srcs[k], NULL);
+
+        int size;
+        char *image = negi_lang_program_save(program, &size);
+        NegiLangProgram *loaded = negi_lang_program_load(image, size, NULL);
+        assert(loaded != NULL);
+
+        const char *err1;
+        const char *err2;
+        assert(run_program(program, &err1) == run_program(loaded, &err2));
+        assert(strcmp(err1, err2) == 0);
+
+        // 壊れたイメージは読み込まない。
+        assert(negi_lang_program_load(image, size - 1, NULL) == NULL);
+        image[size / 2] ^= 1;
+        assert(negi_lang_program_load(image, size, NULL) == NULL);
+        free(image);
+
+        negi_lang_program_delete(program);
+        negi_lang_program_delete(loaded);
+    }
+}
+
+// プログラムをイメージに変換して、読み込めるか試す。
+static bool program_image_is_loadable(const NegiLangProgram *program) {
+    int size;
+    void *image = negi_lang_program_save(program, &size);
+    NegiLangProgram *loaded = negi_lang_program_load(image, size, NULL);
+    free(image);
+
+    bool ok = loaded != NULL;
+    negi_lang_program_delete(loaded);
+    return ok;
+}
+
+// 最初に現れる kind 命令のうち、変数の置き場所が var_kind のものを探す。
+static Cmd *program_find_var_cmd(NegiLangProgram *program, CmdKind kind,
+                                 int var_kind) {
+    Ctx *ctx = program->ctx;
+    for (int i = 0; i < ctx->cmds.len; i++) {
+        Cmd *cmd = &ctx->cmds.data[i];
+        if (cmd->kind == kind &&
+            (kind == cmd_load_global || cmd->y == var_kind)) {
+            return cmd;
+        }
+    }
+    assert(false);
+    return NULL;
+}
+
+// 変数の位置が、その命令を実行する関数から見て範囲外を指すイメージは読み込まない。
+static void test_program_image_vars() {
+    const char *src = "let g = 1;"
+                      "let f = fun(x) { let y = x; fun() { x + y + g } };"
+                      "f(1)()";
+    struct {
+        CmdKind kind;
+        int var_kind;
+    } cases[] = {
+        {cmd_load_local, var_local},
+        {cmd_load_local, var_upval},
+        {cmd_load_global, var_global},
+    };
+
+    NegiLangProgram *program = negi_lang_compile(src, NULL);
+    assert(program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+
+    for (int k = 0; k < (int)array_len(cases); k++) {
+        program = negi_lang_compile(src, NULL);
+        Cmd *cmd = program_find_var_cmd(program, cases[k].kind,
+                                        cases[k].var_kind);
+        cmd->x = 2;
+        assert(!program_image_is_loadable(program));
+        negi_lang_program_delete(program);
+    }
+
+    // 捕獲変数は、クロージャを生成する関数のローカル変数の範囲内を指す。
+    program = negi_lang_compile(src, NULL);
+    assert(program->ctx->upvals.len >= 1);
+    program->ctx->upvals.data[0].index = 2;
+    assert(!program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+
+    // 関数本体の命令をトップレベルから実行させることはできない。
+    // 関数本体を飛び越えるジャンプを、関数本体の先頭に向ける。
+    program = negi_lang_compile(src, NULL);
+    Ctx *ctx = program->ctx;
+    int jump_i = ctx->cmd_i_entry;
+    while (ctx->cmds.data[jump_i].kind != cmd_jump) {
+        jump_i++;
+    }
+    ctx->cmds.data[jump_i].x = jump_i + 1;
+    assert(!program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+}
+
+// 演算の命令は、コンパイラが生成しうる演算子だけを持つ。
+// また、フレームの開始時より下にあるスタックの値を下ろさない。
+static void test_program_image_cmds() {
+    const char *src = "let a = [1]; a[0] = 2; a[0] + 3";
+
+    // 最後の演算 (+) の演算子を書き換える。
+    OpKind ops[] = {op_set, op_set_add, op_log_or, op_log_and, op_semi};
+    for (int k = 0; k < (int)array_len(ops); k++) {
+        NegiLangProgram *program = negi_lang_compile(src, NULL);
+        Ctx *ctx = program->ctx;
+        int op_i = ctx->cmds.len - 1;
+        while (ctx->cmds.data[op_i].kind != cmd_op) {
+            op_i--;
+        }
+        ctx->cmds.data[op_i].x = ops[k];
+        assert(!program_image_is_loadable(program));
+        negi_lang_program_delete(program);
+    }
+
+    // 配列の要素への代入は、代入か算術の複合代入に限る。
+    NegiLangProgram *program = negi_lang_compile(src, NULL);
+    Ctx *ctx = program->ctx;
+    // 覗き穴最適化を無効にしてビルドしたなら、値を下ろす命令とまとめられない。
+    int set_i = 0;
+    while (ctx->cmds.data[set_i].kind != cmd_index_set &&
+           ctx->cmds.data[set_i].kind != cmd_index_set_pop) {
+        set_i++;
+    }
+    ctx->cmds.data[set_i].x = op_index;
+    assert(!program_image_is_loadable(program));
+    ctx->cmds.data[set_i].x = op_add;
+    assert(program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+
+    // トップレベルの最初の命令で値を下ろすことはできない。
+    program = negi_lang_compile(src, NULL);
+    ctx = program->ctx;
+    ctx->cmds.data[ctx->cmd_i_entry].kind = cmd_pop;
+    assert(!program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+
+    // 関数の戻り値を積まずに戻ることはできない。
+    program = negi_lang_compile("let f = fun() { 1 }; f()", NULL);
+    ctx = program->ctx;
+    int push_i = ctx->funs.data[0].cmd_i;
+    assert(ctx->cmds.data[push_i].kind == cmd_push_int);
+    ctx->cmds.data[push_i].kind = cmd_pop;
+    assert(!program_image_is_loadable(program));
+    negi_lang_program_delete(program);
+
+    // 配列でない値への要素の追加は、実行時に型エラーになる。
+    program = negi_lang_compile("let x = 1; x + 2", NULL);
+    ctx = program->ctx;
+    int op_i = 0;
+    while (ctx->cmds.data[op_i].kind != cmd_op) {
+        op_i++;
+    }
+    ctx->cmds.data[op_i].x = op_array_push;
+    int size;
+    void *image = negi_lang_program_save(program, &size);
+    NegiLangProgram *loaded = negi_lang_program_load(image, size, NULL);
+    assert(loaded != NULL);
+    const char *err;
+    assert(run_program(loaded, &err) == 1 && strstr(err, "型エラー") != NULL);
+    free(image);
+    negi_lang_program_delete(loaded);
+    negi_lang_program_delete(program);
+
+    // 読み込めないファイルは NULL になる。
+    assert(negi_lang_program_load_file("/", NULL) == NULL);
+}
+
+static int host_call_count;
+
+static const char *host_count_up(struct NegiLangContext *ctx,
+                                 const NegiLangCell *args, int argc,
+                                 NegiLangCell *result) {
+    host_call_count += argc + 1;
+    return NULL;
+}
+
+// 引数の整数の和を返す。整数でない引数があれば失敗する。
+static const char *host_sum(struct NegiLangContext *ctx,
+                            const NegiLangCell *args, int argc,
+                            NegiLangCell *result) {
+    int sum = 0;
+    for (int i = 0; i < argc; i++) {
+        if (args[i].ty != negi_lang_ty_int) {
+            return "host_sum error";
+        }
+        sum += args[i].val;
+    }
+    *result = negi_lang_cell_int(sum);
+    return NULL;
+}
+
+// 文字列を2回繰り返した文字列を返す。
+static const char *host_twice(struct NegiLangContext *ctx,
+                              const NegiLangCell *args, int argc,
+                              NegiLangCell *result) {
+    const char *str = negi_lang_cell_str_value(ctx, args[0]);
+    if (str == NULL) {
+        return "host_twice error";
+    }
+
+    int len = strlen(str);
+    char *buf = malloc(len * 2 + 1);
+    memcpy(buf, str, len);
+    memcpy(buf + len, str, len + 1);
+    *result = negi_lang_cell_str(ctx, buf);
+    free(buf);
+    return NULL;
+}
+
+// 登録簿に登録した外部関数を呼び出せる。組み込み関数より優先される。
+static void test_registry() {
+    NegiLangRegistry *registry = negi_lang_registry_new();
+    negi_lang_registry_add(registry, "count_up", -1, host_count_up);
+    negi_lang_registry_add(registry, "assert", -1, host_count_up);
+    negi_lang_registry_add(registry, "sum3", 3, host_sum);
+    negi_lang_registry_add(registry, "twice", 1, host_twice);
+
+    const char *err;
+    const char *src = "count_up(); let f = count_up; f(1, 2); assert(0); 4";
+    NegiLangProgram *program = negi_lang_compile(src, registry);
+
+    host_call_count = 0;
+    assert(run_program(program, &err) == 4);
+    assert(host_call_count == 1 + 3 + 2);
+
+    // イメージを読み込むときも、外部関数を登録簿から探す。
+    int size;
+    char *image = negi_lang_program_save(program, &size);
+    assert(negi_lang_program_load(image, size, NULL) == NULL);
+
+    NegiLangProgram *loaded = negi_lang_program_load(image, size, registry);
+    assert(loaded != NULL);
+    host_call_count = 0;
+    assert(run_program(loaded, &err) == 4);
+    assert(host_call_count == 1 + 3 + 2);
+    free(image);
+    negi_lang_program_delete(program);
+    negi_lang_program_delete(loaded);
+
+    // 外部関数は引数をスタックから借用し、戻り値を返せる。
+    src = "let f = sum3; let x = sum3(1, 2, 3) + f(4, 5, 6); x";
+    assert(run_src(src, registry, &err) == 21);
+    src = "sum3(1, 2, [])";
+    assert(run_src(src, registry, &err) == 1);
+    assert(strstr(err, "host_sum error") != NULL);
+
+    // 外部関数は公開された補助関数で文字列を読み書きできる。
+    src = "let s = twice(\"ab\"); s == \"abab\" ? val_type(s) : 0";
+    assert(run_src(src, registry, &err) == negi_lang_ty_str);
+    src = "twice(1)";
+    assert(run_src(src, registry, &err) == 1);
+    assert(strstr(err, "host_twice error") != NULL);
+
+    // 引数の個数は、名前で呼び出す箇所では束縛時に、関数値の呼び出しでは実行時に検査する。
+    src = "count_up(); sum3(1, 2)";
+    host_call_count = 0;
+    assert(run_src(src, registry, &err) == 1);
+    assert(host_call_count == 1);
+    assert(strstr(err, "引数の個数が一致しません。") != NULL);
+    src = "let f = sum3; f(1, 2, 3, 4)";
+    assert(run_src(src, registry, &err) == 1);
+    assert(strstr(err, "引数の個数が一致しません。") != NULL);
+
+    // 登録し直して引数の個数が変わったら、イメージは読み込めない。
+    program = negi_lang_compile("sum3(1, 2, 3)", registry);
+    image = negi_lang_program_save(program, &size);
+    negi_lang_registry_add(registry, "sum3", 2, host_sum);
+    assert(negi_lang_program_load(image, size, registry) == NULL);
+    free(image);
+    negi_lang_program_delete(program);
+
+    negi_lang_registry_delete(registry);
+    negi_lang_registry_delete(NULL);
+}
+
+// 覗き穴最適化の規則は、コンパイルの設定で個別に無効にできる。
+// 規則を無効にしても結果は変わらず、取り除かれない命令の分だけイメージが大きくなる。
+static void test_compile_options() {
+    const char *src = "let s = 0;"
+                      "let i = 0;"
+                      "while (10 > i) {"
+                      "  let odd = i % 2 != 0;"
+                      "  if (odd) { s += i };"
+                      "  i += 1"
+                      "};"
+                      "1;"
+                      "s";
+    const int rules[] = {
+        negi_lang_peephole_cmp,
+        negi_lang_peephole_set_pop,
+        negi_lang_peephole_push_pop,
+        negi_lang_peephole_jump_next,
+        negi_lang_peephole_all,
+    };
+
+    const char *err;
+    NegiLangProgram *program = negi_lang_compile_with_options(src, NULL, NULL);
+    int size;
+    free(negi_lang_program_save(program, &size));
+    assert(run_program(program, &err) == 25);
+    negi_lang_program_delete(program);
+
+    for (int i = 0; i < (int)(sizeof(rules) / sizeof(rules[0])); i++) {
+        NegiLangCompileOptions options = {.peephole_disabled = rules[i]};
+        program = negi_lang_compile_with_options(src, NULL, &options);
+
+        int disabled_size;
+        free(negi_lang_program_save(program, &disabled_size));
+        assert(disabled_size >= size);
+#ifndef NEGI_LANG_NO_PEEPHOLE
+        // このソースコードでは、直後のラベルへのジャンプは生成されない。
+        assert(rules[i] == negi_lang_peephole_jump_next ||
+               disabled_size > size);
+#endif
+        assert(run_program(program, &err) == 25);
+        negi_lang_program_delete(program);
+    }
+}
+
+// 文字列のバッファや詰めた配列は参照セルの外に確保されるが、GC の対象として数えられる。
+// 参照セルをほとんど使わずにゴミを作り続けても、メモリ使用量は増え続けない。
+static void test_gc_malloc() {
+    NegiLangProgram *program = negi_lang_compile(
+        "let s = \"x\";"
+        "let i = 0;"
+        "while (i < 13) { s += s; i += 1 };"
+        "i = 0;"
+        "while (i < 20000) { let t = s + \"y\"; i += 1 };"
+        "i = 0;"
+        "while (i < 10000) {"
+        "  let a = [0, 0, 0, 0]; let j = 0;"
+        "  while (j < 500) { array_push(a, j); j += 1 };"
+        "  i += 1"
+        "};"
+        "7",
+        NULL);
+    struct NegiLangContext *ctx = negi_lang_context_new(program);
+
+    int exit = 0;
+    const char *err;
+    NegiLangExternals externals = (NegiLangExternals){
+        .exit_code = &exit,
+        .output = &err,
+        .stdin_to_str = stdin_to_str,
+    };
+    assert(negi_lang_run(ctx, &externals) == 7);
+    assert(ctx->gc_malloc_bytes < 2 * gc_malloc_threshold_min);
+    assert(ctx->arrays.len < 5000);
+
+    negi_lang_context_delete(ctx);
+}
+
+// 加算代入の合間に変数の文字列を比較しても、変数は文字列を所有し続ける。
+// (所有しなくなると、加算代入のたびに文字列全体が複製される。)
+static void test_str_owner() {
+    NegiLangProgram *program = negi_lang_compile(
+        "let s = \"\"; let n = 0; let i = 0;"
+        "while (i < 1000) {"
+        "  s += \"x\";"
+        "  if (s == \"y\") { n = 1 };"
+        "  n += val_type(s) + str_slice(s, 0, 1)[0];"
+        "  i += 1"
+        "};"
+        "n",
+        NULL);
+    struct NegiLangContext *ctx = negi_lang_context_new(program);
+
+    const char *err;
+    NegiLangExternals externals = (NegiLangExternals){
+        .output = &err,
+        .stdin_to_str = stdin_to_str,
+    };
+    negi_lang_run(ctx, &externals);
+    assert(strcmp(err, "") == 0);
+
+    // s はグローバル変数の先頭にある。
+    Cell s = ctx->cells.data[stack_len_min];
+    assert(s.ty == ty_str && ctx->strs.data[s.val].len == 1000);
+    assert(ctx->strs.data[s.val].owner == stack_len_min);
+
+    negi_lang_context_delete(ctx);
+    negi_lang_program_delete(program);
+}
+
+// ヒープの上限の近くでは、空きに応じて GC の間隔を決め、空きがなくなったらメモリ不足とする。
+// (GC を命令のたびに繰り返すと、このテストは終わらない。)
+static void test_heap_len_max() {
+    const char *srcs[] = {
+        "let xs = []; let i = 0;"
+        "while (i < 60000) { array_push(xs, [i, \"s\"]); i += 1 };"
+        "5",
+        "let xs = []; let i = 0;"
+        "while (i < 200000) { array_push(xs, [i, \"s\"]); i += 1 };"
+        "5",
+    };
+    int exits[] = {5, 1};
+
+    for (int k = 0; k < (int)array_len(srcs); k++) {
+        NegiLangProgram *program = negi_lang_compile(srcs[k], NULL);
+        struct NegiLangContext *ctx = negi_lang_context_new(program);
+
+        const char *err;
+        NegiLangExternals externals = (NegiLangExternals){
+            .output = &err,
+            .stdin_to_str = stdin_to_str,
+            .heap_len_max = 1,
+        };
+        assert(negi_lang_run(ctx, &externals) == exits[k]);
+        assert(exits[k] == 5 || strstr(err, "OUT OF MEMORY") != NULL);
+
+        negi_lang_context_delete(ctx);
+        negi_lang_program_delete(program);
+    }
+}
+
+void some_tests() {
+    negi_lang_test_util();
+    negi_lang_test_builtins();
+    test_program_reuse();
+    test_program_image();
+    test_program_image_vars();
+    test_program_image_cmds();
+    test_registry();
+    test_compile_options();
+    test_gc_malloc();
+    test_heap_len_max();
+    test_str_owner();
+}
 
 void eval_test_print_heading(int i, bool ok) {
     if (!ok)
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,13 +34,18 @@ void *mem_alloc(int count, int unit) {
         return NULL;
     }
 
-    return calloc(count, unit);
+    void *data = calloc(count, unit);
+    if (data == NULL) {
+        failwith("FATAL ERROR mem_alloc");
+    }
+    return data;
 }
 
 // data をサイズ unit の要素の配列へのポインタとみなして、領域を拡張する。
 // いまのキャパシティ (最大の要素数) が *capacity で、そのうち count
 // 個が使用中であるとする。 これをキャパシティが new_capacity
 // 以上になるように必要なら再確保する。縮めることはない。
+// 再確保したら、元の領域は解放する。
 void mem_reserve(void **data, int count, int unit, int *capacity,
                         int new_capacity) {
     assert(data != NULL);
@@ -58,6 +64,28 @@ void mem_reserve(void **data, int count, int unit, int *capacity,
         assert(*data != NULL);
         memcpy(new_data, *data, count * unit);
     }
+    free(*data);
+
+    *data = new_data;
+    *capacity = new_capacity;
+}
+
+void mem_resize(void **data, int unit, int *capacity, int new_capacity) {
+    assert(data != NULL);
+    assert(unit > 0);
+    assert(capacity != NULL);
+    assert(new_capacity >= 0);
+
+    if (*capacity >= new_capacity) {
+        return;
+    }
+
+    char *new_data = realloc(*data, (size_t)new_capacity * unit);
+    if (new_data == NULL) {
+        failwith("FATAL ERROR mem_resize");
+    }
+    memset(new_data + (size_t)*capacity * unit, 0,
+           (size_t)(new_capacity - *capacity) * unit);
 
     *data = new_data;
     *capacity = new_capacity;
@@ -174,6 +202,82 @@ StringBuilder *sb_new() {
 
 const char *sb_to_str(const StringBuilder *sb) { return sb->data; }
 
+// ###############################################
+// 汎用: ハッシュテーブル
+// ###############################################
+
+// FNV-1a
+unsigned string_hash(const char *str, int len) {
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// キーが入っている位置か、キーを入れるべき空きの位置を返す。
+static int str_map_probe(const StrMapEntry *data, int capacity,
+                         const char *key, int key_len) {
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    int i = (int)(string_hash(key, key_len) & (unsigned)(capacity - 1));
+    while (true) {
+        const StrMapEntry *entry = &data[i];
+        if (entry->key == NULL) {
+            return i;
+        }
+        if (entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            return i;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+}
+
+int str_map_find(const StrMap *map, const char *key, int key_len) {
+    if (map->capacity == 0) {
+        return -1;
+    }
+
+    int i = str_map_probe(map->data, map->capacity, key, key_len);
+    return map->data[i].key != NULL ? map->data[i].value : -1;
+}
+
+void str_map_insert(StrMap *map, const char *key, int key_len, int value) {
+    assert(key != NULL && key_len >= 0 && value >= 0);
+
+    // 使用率が半分を超えないように、2倍の大きさのテーブルに入れなおす。
+    if ((map->len + 1) * 2 > map->capacity) {
+        int new_capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+        StrMapEntry *new_data = mem_alloc(new_capacity, sizeof(StrMapEntry));
+
+        for (int i = 0; i < map->capacity; i++) {
+            const StrMapEntry *entry = &map->data[i];
+            if (entry->key == NULL) {
+                continue;
+            }
+            int j = str_map_probe(new_data, new_capacity, entry->key,
+                                  entry->key_len);
+            new_data[j] = *entry;
+        }
+
+        free(map->data);
+        map->data = new_data;
+        map->capacity = new_capacity;
+    }
+
+    int i = str_map_probe(map->data, map->capacity, key, key_len);
+    if (map->data[i].key == NULL) {
+        map->len++;
+    }
+    map->data[i] = (StrMapEntry){
+        .key = key,
+        .key_len = key_len,
+        .value = value,
+    };
+}
+
 // ###############################################
 // 汎用: 整数のベクタ
 // ###############################################
@@ -40,6 +40,10 @@ extern void mem_reserve(void **data, int count, int unit, int *capacity,
                  int new_capacity);
 extern void *mem_alloc(int count, int unit);
 
+// mem_reserve と同様に領域を拡張するが、古い領域は解放する。
+// 拡張された部分はゼロで埋める。
+extern void mem_resize(void **data, int unit, int *capacity, int new_capacity);
+
 extern void vec_grow(void **data, int len, int *capacity, int unit, int grow_size);
 
 extern char *string_slice(const char *str, int l, int r);
@@ -54,6 +58,34 @@ extern const char *sb_to_str(const StringBuilder *sb);
 extern VecInt *vec_int_new();
 extern void vec_int_push(VecInt *vec, int value);
 
+// -----------------------------------------------
+// 文字列をキーとするハッシュテーブル
+// -----------------------------------------------
+
+typedef struct StrMapEntry {
+    // キーの文字列 (空きならNULL)。ゼロ終端でなくてもよい。
+    const char *key;
+    int key_len;
+    int value;
+} StrMapEntry;
+
+// 文字列をキー、非負整数を値とするハッシュテーブル。(オープンアドレス法)
+// キーの文字列はコピーしないので、テーブルより長く生存しなければいけない。
+typedef struct StrMap {
+    StrMapEntry *data;
+    int len;
+    int capacity;
+} StrMap;
+
+extern unsigned string_hash(const char *str, int len);
+
+// キーに対応する値を返す。なければ -1 を返す。
+extern int str_map_find(const StrMap *map, const char *key, int key_len);
+
+// キーに値を対応させる。すでにあるキーなら値を上書きする。
+extern void str_map_insert(StrMap *map, const char *key, int key_len,
+                           int value);
+
 // ###############################################
 // デバッグ用
 // ###############################################